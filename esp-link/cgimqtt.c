@@ -52,6 +52,7 @@ int ICACHE_FLASH_ATTR cgiMqttGet(HttpdConnData *connData) {
       "\"mqtt-enable\":%d, "
       "\"mqtt-state\":\"%s\", "
       "\"mqtt-status-enable\":%d, "
+      "\"mqtt-tlv-stats\":%d, "
       "\"mqtt-clean-session\":%d, "
       "\"mqtt-port\":%d, "
       "\"mqtt-timeout\":%d, "
@@ -64,6 +65,7 @@ int ICACHE_FLASH_ATTR cgiMqttGet(HttpdConnData *connData) {
       "\"mqtt-status-value\":\"%s\" }",
       flashConfig.slip_enable, flashConfig.mqtt_enable,
       mqtt_states[mqttClient.connState], flashConfig.mqtt_status_enable,
+      flashConfig.mqtt_tlv_stats,
       flashConfig.mqtt_clean_session, flashConfig.mqtt_port,
       flashConfig.mqtt_timeout, flashConfig.mqtt_keepalive,
       flashConfig.mqtt_host, flashConfig.mqtt_clientid,
@@ -147,6 +149,8 @@ int ICACHE_FLASH_ATTR cgiMqttSet(HttpdConnData *connData) {
   // next status tick
   if (getBoolArg(connData, "mqtt-status-enable", &flashConfig.mqtt_status_enable) < 0)
     return HTTPD_CGI_DONE;
+  if (getBoolArg(connData, "mqtt-tlv-stats", &flashConfig.mqtt_tlv_stats) < 0)
+    return HTTPD_CGI_DONE;
   if (getStringArg(connData, "mqtt-status-topic",
         flashConfig.mqtt_status_topic, sizeof(flashConfig.mqtt_status_topic)) < 0)
     return HTTPD_CGI_DONE;
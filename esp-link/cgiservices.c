@@ -2,6 +2,15 @@
 #include "cgiwifi.h"
 #include "cgi.h"
 #include "config.h"
+#include "tlv.h"
+#include "task.h"
+#include "tlvtap.h"
+#include "serbridge.h"
+#include "vncbridge.h"
+#include "netbuf.h"
+#include "mempool.h"
+#include "heapstat.h"
+#include "cpuacct.h"
 #ifdef SYSLOG
 #include "syslog.h"
 #else
@@ -34,8 +43,10 @@ int ICACHE_FLASH_ATTR cgiSystemSet(HttpdConnData *connData) {
 
   int8_t n = getStringArg(connData, "name", flashConfig.hostname, sizeof(flashConfig.hostname));
   int8_t d = getStringArg(connData, "description", flashConfig.sys_descr, sizeof(flashConfig.sys_descr));
+  int8_t b = n < 0 || d < 0 ? 0 :
+    getUInt16Arg(connData, "cpu_budget_us", &flashConfig.cpu_budget_us);
 
-  if (n < 0 || d < 0) return HTTPD_CGI_DONE; // getStringArg has produced an error response
+  if (n < 0 || d < 0 || b < 0) return HTTPD_CGI_DONE; // getStringArg has produced an error response
 
   if (n > 0) {
     // schedule hostname change-over
@@ -65,6 +76,19 @@ int ICACHE_FLASH_ATTR cgiSystemInfo(HttpdConnData *connData) {
   uint8 part_id = system_upgrade_userbin_check();
   uint32_t fid = spi_flash_get_id();
   struct rst_info *rst_info = system_get_rst_info();
+  const usr_task_stats_t *tu = usr_task_stats(USR_TASK_PRIO_UART);
+  const usr_task_stats_t *th = usr_task_stats(USR_TASK_PRIO_HID);
+  const usr_task_stats_t *tb = usr_task_stats(USR_TASK_PRIO_BULK);
+
+  // per pool: size:in use/reserved (max), then the total that fell back to the heap
+  char pools[128], *p = pools;
+  uint32_t pool_exhausted = 0;
+  for (uint8_t c=0; c<MEMPOOL_CLASSES; c++) {
+    const mempool_stats_t *mp = mempool_stats(c);
+    p += os_sprintf(p, "%d:%d/%d (%d) ", mp->size, mp->in_use, mp->count, mp->max_in_use);
+    pool_exhausted += mp->exhausted;
+  }
+  os_sprintf(p, "%ld on heap", pool_exhausted);
 
   os_sprintf(buff,
     "{ "
@@ -76,6 +100,13 @@ int ICACHE_FLASH_ATTR cgiSystemInfo(HttpdConnData *connData) {
       "\"slip\": \"%s\", "
       "\"mqtt\": \"%s/%s\", "
       "\"baud\": \"%ld\", "
+      "\"link_baud\": \"%ld\", "
+      "\"loop_stall\": \"%ldus\", "
+      "\"netbufs\": \"%d/%d in use, max %d, %ld refused\", "
+      "\"tasks\": \"max queued %d/%d/%d, %ld coalesced, %ld dropped\", "
+      "\"mempool\": \"%s\", "
+      "\"heap\": \"free %ld (min %ld), largest block %ld (min %ld)\", "
+      "\"cpu_budget_us\": \"%d\", "
       "\"description\": \"%s\""
     " }",
     flashConfig.hostname,
@@ -88,6 +119,14 @@ int ICACHE_FLASH_ATTR cgiSystemInfo(HttpdConnData *connData) {
     flashConfig.mqtt_enable ? "enabled" : "disabled",
     mqttState(),
     flashConfig.baud_rate,
+    tlv_baud_rate(),
+    stall_probe_max(),
+    netbuf_stats.in_use, netbuf_stats.allocated, netbuf_stats.max_in_use, netbuf_stats.exhausted,
+    tu->high_water, th->high_water, tb->high_water,
+    tu->coalesced + th->coalesced + tb->coalesced, tu->dropped + th->dropped + tb->dropped,
+    pools,
+    heap_stats.free, heap_stats.free_min, heap_stats.largest, heap_stats.largest_min,
+    flashConfig.cpu_budget_us,
     flashConfig.sys_descr
     );
 
@@ -96,6 +135,67 @@ int ICACHE_FLASH_ATTR cgiSystemInfo(HttpdConnData *connData) {
   return HTTPD_CGI_DONE;
 }
 
+// Cgi to return the CPU time accounting of tasks and network callbacks
+int ICACHE_FLASH_ATTR cgiSystemCpu(HttpdConnData *connData) {
+  char buff[2048];
+  char *p = buff, *end = buff + sizeof(buff) - 160; // room for the largest single item below
+
+  if (connData->conn == NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  uint32_t mhz = system_get_cpu_freq();
+  uint32_t worst_cycles;
+  const cpuacct_t *worst = cpuacct_worst(&worst_cycles);
+  p += os_sprintf(p, "{ \"cpu_mhz\": %ld, \"budget_us\": %d, \"window_ms\": %d, "
+      "\"worst\": { \"name\": \"%s\", \"cycles\": %ld, \"us\": %ld }, \"entries\": [",
+      mhz, flashConfig.cpu_budget_us, CPUACCT_WINDOW_MS, worst ? worst->name : "",
+      worst_cycles, worst_cycles / mhz);
+  for (const cpuacct_t *a = cpuacct_list(); a != NULL && p < end; a = a->next) {
+    p += os_sprintf(p, "%s{ \"name\": \"%s\", \"runs\": %ld, \"total_ms\": %ld, "
+        "\"avg_us\": %ld, \"max_cycles\": %ld, \"max_us\": %ld }",
+        a == cpuacct_list() ? "" : ", ", a->name, a->runs, (uint32_t)(a->total / (mhz * 1000)),
+        a->runs ? (uint32_t)(a->total / a->runs) / mhz : 0, a->max, a->max / mhz);
+  }
+  p += os_sprintf(p, "] }");
+
+  jsonHeader(connData, 200);
+  httpdSend(connData, buff, p - buff);
+  return HTTPD_CGI_DONE;
+}
+
+// Cgi to return the heap telemetry: free heap and largest block with their minimums, and the
+// allocations of each module that goes through heap_malloc
+int ICACHE_FLASH_ATTR cgiSystemHeap(HttpdConnData *connData) {
+  char buff[1536];
+  char *p = buff;
+
+  if (connData->conn == NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  p += os_sprintf(p, "{ \"free\": %ld, \"free_min\": %ld, \"largest\": %ld, \"largest_min\": %ld, "
+      "\"modules\": [", heap_stats.free, heap_stats.free_min, heap_stats.largest,
+      heap_stats.largest_min);
+  for (uint8_t m=0; m<HEAP_MODULES; m++) {
+    const heap_mod_stats_t *ms = heap_mod_stats(m);
+    p += os_sprintf(p, "%s{ \"name\": \"%s\", \"allocs\": %ld, \"frees\": %ld, \"failed\": %ld, "
+        "\"outstanding\": %ld, \"bytes\": %ld, \"max_bytes\": %ld, \"growing\": %d }",
+        m == 0 ? "" : ", ", heap_mod_name(m), ms->allocs, ms->frees, ms->failed,
+        ms->allocs - ms->frees, ms->bytes, ms->max_bytes, ms->growing);
+  }
+  // leak report: modules whose outstanding bytes kept going up
+  p += os_sprintf(p, "], \"leak_windows\": %d, \"leak_window_s\": %d, \"leaks\": [",
+      HEAP_LEAK_WINDOWS, HEAP_LEAK_WINDOW * HEAP_SAMPLE_MS / 1000);
+  bool first = true;
+  for (uint8_t m=0; m<HEAP_MODULES; m++) {
+    if (!heap_leak_suspect(m)) continue;
+    p += os_sprintf(p, "%s\"%s\"", first ? "" : ", ", heap_mod_name(m));
+    first = false;
+  }
+  p += os_sprintf(p, "] }");
+
+  jsonHeader(connData, 200);
+  httpdSend(connData, buff, p - buff);
+  return HTTPD_CGI_DONE;
+}
+
 void ICACHE_FLASH_ATTR cgiServicesSNTPInit() {
   if (flashConfig.sntp_server[0] != '\0') {    
     sntp_stop();
@@ -107,32 +207,69 @@ void ICACHE_FLASH_ATTR cgiServicesSNTPInit() {
   }
 }
 
+// Summarize what send coalescing does on a port: rate and size of the TCP segments and how long
+// data got held back for them
+static void ICACHE_FLASH_ATTR txStatsStr(char *buf, const txc_stats_t *s) {
+  os_sprintf(buf, "%ld seg/s, avg %ld bytes/seg, held avg %ldus max %ldus", s->seg_rate,
+      s->segments ? s->bytes / s->segments : 0, s->batches ? s->hold_total_us / s->batches : 0,
+      s->hold_max_us);
+}
+
 int ICACHE_FLASH_ATTR cgiServicesInfo(HttpdConnData *connData) {
-  char buff[1024];
+  char buff[1536];
+  char serStats[80], vncStats[80];
 
   if (connData->conn == NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
 
+  txStatsStr(serStats, &serbridgeTxStats);
+  txStatsStr(vncStats, &vncbridgeTxStats);
   os_sprintf(buff, 
     "{ "
       "\"syslog_host\": \"%s\", "
       "\"syslog_minheap\": %d, "
+      "\"syslog_heap_s\": %d, "
       "\"syslog_filter\": %d, "
       "\"syslog_showtick\": \"%s\", "
       "\"syslog_showdate\": \"%s\", "
       "\"timezone_offset\": %d, "
       "\"sntp_server\": \"%s\", "
       "\"mdns_enable\": \"%s\", "
-      "\"mdns_servername\": \"%s\""
+      "\"mdns_servername\": \"%s\", "
+      "\"vnc_pointer\": %d, "
+      "\"vnc_keyboard\": %d, "
+      "\"vnc_batch\": \"%s\", "
+      "\"tlv_tap_port\": %d, "
+      "\"ser_tx_mode\": %d, "
+      "\"ser_tx_delay_us\": %d, "
+      "\"ser_tx_bytes\": %d, "
+      "\"ser_tx_stats\": \"%s\", "
+      "\"vnc_tx_mode\": %d, "
+      "\"vnc_tx_delay_us\": %d, "
+      "\"vnc_tx_bytes\": %d, "
+      "\"vnc_tx_stats\": \"%s\""
     " }",    
     flashConfig.syslog_host,
     flashConfig.syslog_minheap,
+    flashConfig.syslog_heap_s,
     flashConfig.syslog_filter,
     flashConfig.syslog_showtick ? "enabled" : "disabled",
     flashConfig.syslog_showdate ? "enabled" : "disabled",
     flashConfig.timezone_offset,
     flashConfig.sntp_server,
     flashConfig.mdns_enable ? "enabled" : "disabled",
-    flashConfig.mdns_servername
+    flashConfig.mdns_servername,
+    flashConfig.vnc_pointer,
+    flashConfig.vnc_keyboard,
+    flashConfig.vnc_batch ? "enabled" : "disabled",
+    flashConfig.tlv_tap_port,
+    flashConfig.ser_tx_mode,
+    flashConfig.ser_tx_delay_us,
+    flashConfig.ser_tx_bytes,
+    serStats,
+    flashConfig.vnc_tx_mode,
+    flashConfig.vnc_tx_delay_us,
+    flashConfig.vnc_tx_bytes,
+    vncStats
     );
 
   jsonHeader(connData, 200);
@@ -159,6 +296,8 @@ int ICACHE_FLASH_ATTR cgiServicesSet(HttpdConnData *connData) {
   if (syslog > 0) {
     syslog_init(flashConfig.syslog_host);
   }
+  // picked up by the heap sampler, no need to restart syslog
+  if (getUInt16Arg(connData, "syslog_heap_s", &flashConfig.syslog_heap_s) < 0) return HTTPD_CGI_DONE;
 
   int8_t sntp = 0;
   sntp |= getInt8Arg(connData, "timezone_offset", &flashConfig.timezone_offset);
@@ -208,6 +347,28 @@ int ICACHE_FLASH_ATTR cgiServicesSet(HttpdConnData *connData) {
     }
   }
 
+  // VNC settings are latched when a client connects, so there is nothing to restart
+  if (getUInt8Arg(connData, "vnc_pointer", &flashConfig.vnc_pointer) < 0) return HTTPD_CGI_DONE;
+  if (getUInt8Arg(connData, "vnc_keyboard", &flashConfig.vnc_keyboard) < 0) return HTTPD_CGI_DONE;
+  if (getBoolArg(connData, "vnc_batch", &flashConfig.vnc_batch) < 0) return HTTPD_CGI_DONE;
+
+  int8_t tap = getUInt16Arg(connData, "tlv_tap_port", &flashConfig.tlv_tap_port);
+  if (tap < 0) return HTTPD_CGI_DONE;
+  if (tap > 0) tlvTapInit(flashConfig.tlv_tap_port);
+
+  // send coalescing, the serial port picks up a change right away, VNC with the next connection
+  int8_t ser = 0;
+  ser |= getUInt8Arg(connData, "ser_tx_mode", &flashConfig.ser_tx_mode);
+  if (ser < 0) return HTTPD_CGI_DONE;
+  ser |= getUInt16Arg(connData, "ser_tx_delay_us", &flashConfig.ser_tx_delay_us);
+  if (ser < 0) return HTTPD_CGI_DONE;
+  ser |= getUInt16Arg(connData, "ser_tx_bytes", &flashConfig.ser_tx_bytes);
+  if (ser < 0) return HTTPD_CGI_DONE;
+  if (getUInt8Arg(connData, "vnc_tx_mode", &flashConfig.vnc_tx_mode) < 0) return HTTPD_CGI_DONE;
+  if (getUInt16Arg(connData, "vnc_tx_delay_us", &flashConfig.vnc_tx_delay_us) < 0) return HTTPD_CGI_DONE;
+  if (getUInt16Arg(connData, "vnc_tx_bytes", &flashConfig.vnc_tx_bytes) < 0) return HTTPD_CGI_DONE;
+  if (ser > 0) serbridgeTxConfig();
+
   if (configSave()) {
     httpdStartResponse(connData, 204);
     httpdEndHeaders(connData);
@@ -5,6 +5,8 @@
 
 int cgiSystemSet(HttpdConnData *connData);
 int cgiSystemInfo(HttpdConnData *connData);
+int cgiSystemCpu(HttpdConnData *connData);
+int cgiSystemHeap(HttpdConnData *connData);
 
 void cgiServicesSNTPInit();
 int cgiServicesInfo(HttpdConnData *connData);
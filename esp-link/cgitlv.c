@@ -0,0 +1,65 @@
+// TLV serial link statistics
+
+#include <esp8266.h>
+#include "cgi.h"
+#include "uart.h"
+#include "tlv.h"
+#include "tlvtap.h"
+#include "cgitlv.h"
+
+// Print the TLV link statistics as JSON into buf, returns the length
+int ICACHE_FLASH_ATTR tlvStatsJson(char *buf, int size) {
+  char *p = buf, *end = buf + size - 160; // room for the largest single item below
+
+  p += os_sprintf(p, "{ \"baud\": %ld, \"pauses\": %ld, \"paused_ms\": %ld, \"resume_ms\": [",
+      tlv_baud_rate(), tlv_link_stats.pauses, tlv_link_stats.paused_ms);
+  for (uint8_t b=0; b<TLV_RESUME_BUCKETS; b++) {
+    if (b < TLV_RESUME_BUCKETS-1)
+      p += os_sprintf(p, "%s{ \"lt\": %d, \"n\": %ld }", b ? ", " : "",
+          tlv_resume_bucket_ms[b], tlv_link_stats.resume_hist[b]);
+    else
+      p += os_sprintf(p, ", { \"ge\": %d, \"n\": %ld }",
+          tlv_resume_bucket_ms[b-1], tlv_link_stats.resume_hist[b]);
+  }
+
+  p += os_sprintf(p, "], \"errors\": { \"crc\": %ld, \"length\": %ld, \"skipped\": %ld, "
+      "\"resyncs\": %ld, \"uart_framing\": %ld, \"uart_overflows\": %ld, \"reassembly\": %ld, "
+      "\"busy_drops\": %ld }, \"stalls\": %ld, \"wakeups_avoided\": %ld, \"queues\": [",
+      tlv_frame_errors.crc_errors, tlv_frame_errors.length_errors, tlv_frame_errors.skipped,
+      tlv_frame_errors.resyncs, uart0_rx_frame_errors(), uart0_rx_overflows(), tlv_reasm_errors,
+      tlv_busy_drops, tlv_stalls, tlv_wakeups_avoided);
+  for (uint8_t q=0; q<TLV_TXQ_COUNT; q++) {
+    const tlv_queue_stats_t *qs = tlv_queue_stats(q);
+    p += os_sprintf(p, "%s{ \"channel\": %d, \"depth\": %d, \"max_depth\": %d, \"sent\": %ld, "
+        "\"wait_avg_us\": %ld, \"wait_max_us\": %ld }", q ? ", " : "", q, qs->depth, qs->max_depth,
+        qs->sent, qs->sent ? qs->wait_total_us / qs->sent : 0, qs->wait_max_us);
+  }
+
+  p += os_sprintf(p, "], \"channels\": [");
+  uint8_t n = tlv_stats_channels();
+  for (uint8_t i=0; i<=n && p < end; i++) {
+    uint8_t channel;
+    const tlv_chan_stats_t *cs = tlv_stats_channel(i, &channel);
+    if (i == n && cs->tx_frames == 0 && cs->rx_frames == 0) break; // no unslotted traffic
+    p += os_sprintf(p, "%s{ \"channel\": %d, \"tx_frames\": %ld, \"tx_bytes\": %ld, "
+        "\"rx_frames\": %ld, \"rx_bytes\": %ld, \"rejected\": %ld }", i ? ", " : "",
+        channel == 0xFF ? -1 : channel, cs->tx_frames, cs->tx_bytes, cs->rx_frames, cs->rx_bytes,
+        cs->rejected);
+  }
+  p += os_sprintf(p, "], \"tap\": { \"active\": %d, \"clients\": %ld, \"records\": %ld, "
+      "\"dropped\": %ld } }", tlv_tap_active(), tlv_tap_stats.clients, tlv_tap_stats.records,
+      tlv_tap_stats.dropped);
+  return p - buf;
+}
+
+// Cgi to return the TLV link statistics
+int ICACHE_FLASH_ATTR cgiTlvStats(HttpdConnData *connData) {
+  char buff[2048];
+
+  if (connData->conn == NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  int len = tlvStatsJson(buff, sizeof(buff));
+  jsonHeader(connData, 200);
+  httpdSend(connData, buff, len);
+  return HTTPD_CGI_DONE;
+}
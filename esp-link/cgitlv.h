@@ -0,0 +1,10 @@
+#ifndef CGITLV_H
+#define CGITLV_H
+
+#include "httpd.h"
+
+// Print the TLV link statistics as JSON into buf, returns the length
+int tlvStatsJson(char *buf, int size);
+int cgiTlvStats(HttpdConnData *connData);
+
+#endif
@@ -30,7 +30,16 @@ FlashConfig flashDefault = {
   .rx_pullup	  = 1,  
   .sntp_server  = "us.pool.ntp.org\0",
   .syslog_host = "\0", .syslog_minheap = 8192, .syslog_filter = 7, .syslog_showtick = 1, .syslog_showdate = 0,
-  .mdns_enable = 1, .mdns_servername = "http\0", .timezone_offset = 0
+  .mdns_enable = 1, .mdns_servername = "http\0", .timezone_offset = 0,
+  .vnc_pointer = 0, .vnc_keyboard = 0, .vnc_batch = 0,
+  .uart_rx_full = 0, .uart_rx_tout = 0,
+  .mqtt_tlv_stats = 0,
+  .tlv_tap_port = 0,
+  .ser_tx_mode = 0, .vnc_tx_mode = 0,
+  .ser_tx_delay_us = 0, .vnc_tx_delay_us = 0,
+  .ser_tx_bytes = 0, .vnc_tx_bytes = 0,
+  .cpu_budget_us = 20000,
+  .syslog_heap_s = 0,
 };
 
 typedef union {
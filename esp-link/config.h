@@ -37,6 +37,17 @@ typedef struct {
   uint8_t  mdns_enable;
   char     mdns_servername[32];           
   int8_t   timezone_offset;
+  uint8_t  vnc_pointer;                 // VNC pointer reports: 0=relative mouse, 1=absolute
+  uint8_t  vnc_keyboard;                // VNC keyboard reports: 0=2-byte, 1=NKRO changes
+  uint8_t  vnc_batch;                   // pack VNC HID reports into TLV_HID_BATCH frames
+  uint8_t  uart_rx_full, uart_rx_tout;  // UART0 rx interrupt thresholds, 0=default
+  uint8_t  mqtt_tlv_stats;              // publish TLV link stats with the MQTT status
+  uint16_t tlv_tap_port;                // TCP port streaming a capture of the TLV link, 0=off
+  uint8_t  ser_tx_mode, vnc_tx_mode;    // TCP send coalescing per port, see txcoalesce.h
+  uint16_t ser_tx_delay_us, vnc_tx_delay_us;
+  uint16_t ser_tx_bytes, vnc_tx_bytes;
+  uint16_t cpu_budget_us;               // log callbacks that run longer than this, 0=off
+  uint16_t syslog_heap_s;               // push heap stats to syslog every n seconds, 0=off
 } FlashConfig;
 extern FlashConfig flashConfig;
 
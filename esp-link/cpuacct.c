@@ -0,0 +1,65 @@
+// CPU time accounting, see cpuacct.h
+
+#include <esp8266.h>
+#include "config.h"
+#include "cpuacct.h"
+#ifdef SYSLOG
+#include "syslog.h"
+#else
+#define syslog(a, ...) do {} while (0)
+#endif
+
+static cpuacct_t *acct_head, *acct_tail;
+static const cpuacct_t *acct_worst;   // longest run in the last complete window
+static uint32_t acct_worst_cycles;
+static ETSTimer acct_timer;
+
+void ICACHE_FLASH_ATTR cpuacct_add(cpuacct_t *a, uint32_t cycles) {
+  if (!a->linked) {
+    a->linked = true;
+    if (acct_tail != NULL) acct_tail->next = a;
+    else acct_head = a;
+    acct_tail = a;
+  }
+  a->runs++;
+  a->total += cycles;
+  if (cycles > a->max) a->max = cycles;
+  if (cycles > a->win_max) a->win_max = cycles;
+
+  uint32_t us = cycles / system_get_cpu_freq();
+  if (flashConfig.cpu_budget_us && us > flashConfig.cpu_budget_us && !a->warned) {
+    a->warned = true;
+    os_printf("CPU: %s ran %ldus, budget %dus\n", a->name, us, flashConfig.cpu_budget_us);
+    syslog(SYSLOG_FAC_USER, SYSLOG_PRIO_WARNING, "esp-link", "%s ran %ldus, budget %dus\n",
+        a->name, us, flashConfig.cpu_budget_us);
+  }
+}
+
+// close the window: remember the worst offender and start over
+static void ICACHE_FLASH_ATTR cpuacct_window(void *arg) {
+  acct_worst = NULL;
+  acct_worst_cycles = 0;
+  for (cpuacct_t *a = acct_head; a != NULL; a = a->next) {
+    if (a->win_max > acct_worst_cycles) {
+      acct_worst = a;
+      acct_worst_cycles = a->win_max;
+    }
+    a->win_max = 0;
+    a->warned = false;
+  }
+}
+
+void ICACHE_FLASH_ATTR cpuacct_init(void) {
+  os_timer_disarm(&acct_timer);
+  os_timer_setfn(&acct_timer, cpuacct_window, NULL);
+  os_timer_arm(&acct_timer, CPUACCT_WINDOW_MS, 1);
+}
+
+cpuacct_t * ICACHE_FLASH_ATTR cpuacct_list(void) {
+  return acct_head;
+}
+
+const cpuacct_t * ICACHE_FLASH_ATTR cpuacct_worst(uint32_t *cycles) {
+  *cycles = acct_worst_cycles;
+  return acct_worst;
+}
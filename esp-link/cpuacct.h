@@ -0,0 +1,56 @@
+#ifndef CPUACCT_H
+#define CPUACCT_H
+
+#include <esp8266.h>
+
+/* CPU time accounting for user tasks and network callbacks, measured in CPU cycles (CCOUNT).
+ * Each accounted piece of code has a cpuacct_t, which links itself into the list served by
+ * /system/cpu the first time it runs. A run longer than flashConfig.cpu_budget_us (0=off) is
+ * logged, at most once per window per entry.
+ */
+#define CPUACCT_WINDOW_MS 5000
+
+typedef struct cpuacct {
+  const char *name;
+  struct cpuacct *next;
+  uint32_t runs;
+  uint64_t total;             // cycles
+  uint32_t max;               // longest run in cycles
+  uint32_t win_max;           // longest run in the current window
+  bool linked, warned;
+} cpuacct_t;
+#define CPUACCT_INIT(label) { .name = (label) }
+
+static inline uint32_t cpuacct_ccount(void) {
+  uint32_t c;
+  __asm__ __volatile__("rsr %0, ccount" : "=a"(c));
+  return c;
+}
+
+// account a run of cycles
+void cpuacct_add(cpuacct_t *a, uint32_t cycles);
+// start the window timer
+void cpuacct_init(void);
+// all entries, in the order they first ran
+cpuacct_t *cpuacct_list(void);
+// the entry with the longest run in the last complete window, NULL if nothing ran
+const cpuacct_t *cpuacct_worst(uint32_t *cycles);
+
+// Wrappers to account espconn callbacks: CPUACCT_RECV(fn, "label") defines fn_acct with the
+// signature of an espconn receive callback that runs and accounts fn, likewise for the others
+#define CPUACCT_RECV(fn, label) \
+  static void ICACHE_FLASH_ATTR fn##_acct(void *arg, char *data, unsigned short len) { \
+    static cpuacct_t acct = CPUACCT_INIT(label); \
+    uint32_t t = cpuacct_ccount(); \
+    fn(arg, data, len); \
+    cpuacct_add(&acct, cpuacct_ccount() - t); \
+  }
+#define CPUACCT_CB(fn, label) \
+  static void ICACHE_FLASH_ATTR fn##_acct(void *arg) { \
+    static cpuacct_t acct = CPUACCT_INIT(label); \
+    uint32_t t = cpuacct_ccount(); \
+    fn(arg); \
+    cpuacct_add(&acct, cpuacct_ccount() - t); \
+  }
+
+#endif
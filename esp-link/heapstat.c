@@ -0,0 +1,169 @@
+// Heap telemetry, see heapstat.h
+
+#include <esp8266.h>
+#include "config.h"
+#include "heapstat.h"
+#ifdef SYSLOG
+#include "syslog.h"
+#else
+#define syslog(a, ...) do {} while (0)
+#endif
+
+extern void * mem_trim(void *m, size_t s);	// not well documented...
+
+#define HEAP_MAGIC 0xA5
+
+// prepended to every block handed out by heap_malloc, 4 bytes so the data stays aligned
+typedef struct {
+  uint16_t size;
+  uint8_t  mod;
+  uint8_t  magic;
+} heap_hdr_t;
+
+static const char *heap_mod_names[HEAP_MODULES] = {
+  "httpd", "serbridge", "vnc", "tlv", "tap", "netbuf", "pool",
+};
+
+heap_stats_t heap_stats;
+static heap_mod_stats_t heap_mods[HEAP_MODULES];
+static ETSTimer heap_timer;
+static uint16_t heap_samples;  // since the last leak window
+static uint16_t heap_log_at;   // samples until the next syslog report
+
+static void ICACHE_FLASH_ATTR heap_sample_free(void) {
+  heap_stats.free = system_get_free_heap_size();
+  if (heap_stats.free < heap_stats.free_min) heap_stats.free_min = heap_stats.free;
+}
+
+void * ICACHE_FLASH_ATTR heap_malloc(heap_module_t mod, uint16_t size) {
+  heap_mod_stats_t *ms = &heap_mods[mod];
+  heap_hdr_t *h = os_malloc(sizeof(heap_hdr_t) + size);
+  if (h == NULL) {
+    ms->failed++;
+    os_printf("heap: %s cannot allocate %d bytes, free %ld\n", heap_mod_names[mod], size,
+        (unsigned long)system_get_free_heap_size());
+    return NULL;
+  }
+  h->size = size;
+  h->mod = mod;
+  h->magic = HEAP_MAGIC;
+  ms->allocs++;
+  ms->bytes += size;
+  if (ms->bytes > ms->max_bytes) ms->max_bytes = ms->bytes;
+  heap_sample_free();
+  return h + 1;
+}
+
+void * ICACHE_FLASH_ATTR heap_zalloc(heap_module_t mod, uint16_t size) {
+  void *p = heap_malloc(mod, size);
+  if (p != NULL) os_memset(p, 0, size);
+  return p;
+}
+
+void ICACHE_FLASH_ATTR heap_free(void *p) {
+  if (p == NULL) return;
+  heap_hdr_t *h = (heap_hdr_t *)p - 1;
+  if (h->magic != HEAP_MAGIC || h->mod >= HEAP_MODULES) {
+    // not ours or already freed, leaking it is safer than corrupting the heap
+    os_printf("heap: bad free of %p\n", p);
+    return;
+  }
+  heap_mod_stats_t *ms = &heap_mods[h->mod];
+  ms->frees++;
+  ms->bytes -= h->size;
+  h->magic = 0;
+  os_free(h);
+}
+
+void * ICACHE_FLASH_ATTR heap_trim(void *p, uint16_t size) {
+  heap_hdr_t *h = (heap_hdr_t *)p - 1;
+  if (h->magic != HEAP_MAGIC || size >= h->size) return p;
+  heap_mods[h->mod].bytes -= h->size - size;
+  h->size = size;
+  h = mem_trim(h, sizeof(heap_hdr_t) + size);
+  return h + 1;
+}
+
+const heap_mod_stats_t * ICACHE_FLASH_ATTR heap_mod_stats(heap_module_t mod) {
+  return &heap_mods[mod];
+}
+
+const char * ICACHE_FLASH_ATTR heap_mod_name(heap_module_t mod) {
+  return heap_mod_names[mod];
+}
+
+bool ICACHE_FLASH_ATTR heap_leak_suspect(heap_module_t mod) {
+  return heap_mods[mod].growing >= HEAP_LEAK_WINDOWS;
+}
+
+// The SDK can't tell us the largest free block, so find it by trying: a binary search down to
+// 16 bytes takes a dozen malloc/free pairs
+static uint32_t ICACHE_FLASH_ATTR heap_probe_largest(void) {
+  uint32_t lo = 0, hi = heap_stats.free;
+  while (hi - lo > 16) {
+    uint32_t mid = (lo + hi) / 2;
+    void *p = os_malloc(mid);
+    if (p != NULL) {
+      os_free(p);
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// close a leak window: a module whose outstanding bytes went up again is one step closer to
+// being a suspect, any drop clears it
+static void ICACHE_FLASH_ATTR heap_leak_window(void) {
+  for (uint8_t m=0; m<HEAP_MODULES; m++) {
+    heap_mod_stats_t *ms = &heap_mods[m];
+    if (ms->bytes > ms->last_bytes) {
+      if (++ms->growing == HEAP_LEAK_WINDOWS) {
+        os_printf("heap: %s may leak, %ld bytes outstanding\n", heap_mod_names[m], ms->bytes);
+        syslog(SYSLOG_FAC_USER, SYSLOG_PRIO_WARNING, "esp-link", "heap: %s may leak, %ld bytes outstanding\n",
+            heap_mod_names[m], ms->bytes);
+      }
+      if (ms->growing > HEAP_LEAK_WINDOWS) ms->growing = HEAP_LEAK_WINDOWS;
+    } else if (ms->bytes < ms->last_bytes) {
+      ms->growing = 0;
+    }
+    ms->last_bytes = ms->bytes;
+  }
+}
+
+static void ICACHE_FLASH_ATTR heap_report(void) {
+  uint32_t failed = 0;
+  for (uint8_t m=0; m<HEAP_MODULES; m++) failed += heap_mods[m].failed;
+  syslog(SYSLOG_FAC_USER, SYSLOG_PRIO_INFO, "esp-link",
+      "heap: free %ld (min %ld), largest %ld (min %ld), %ld failed allocs\n",
+      heap_stats.free, heap_stats.free_min, heap_stats.largest, heap_stats.largest_min, failed);
+}
+
+static void ICACHE_FLASH_ATTR heap_sample(void *arg) {
+  heap_sample_free();
+  heap_stats.largest = heap_probe_largest();
+  if (heap_stats.largest < heap_stats.largest_min) heap_stats.largest_min = heap_stats.largest;
+
+  if (++heap_samples == HEAP_LEAK_WINDOW) {
+    heap_samples = 0;
+    heap_leak_window();
+  }
+
+  if (flashConfig.syslog_heap_s == 0 || heap_log_at > flashConfig.syslog_heap_s) {
+    heap_log_at = flashConfig.syslog_heap_s; // off, or the interval just got shorter
+  } else if (heap_log_at <= 1) {
+    heap_report();
+    heap_log_at = flashConfig.syslog_heap_s;
+  } else {
+    heap_log_at--;
+  }
+}
+
+void ICACHE_FLASH_ATTR heapstat_init(void) {
+  heap_stats.free = heap_stats.free_min = system_get_free_heap_size();
+  heap_stats.largest = heap_stats.largest_min = heap_probe_largest();
+  os_timer_disarm(&heap_timer);
+  os_timer_setfn(&heap_timer, heap_sample, NULL);
+  os_timer_arm(&heap_timer, HEAP_SAMPLE_MS, 1);
+}
@@ -0,0 +1,49 @@
+#ifndef HEAPSTAT_H
+#define HEAPSTAT_H
+
+#include <esp8266.h>
+
+/* Heap telemetry: the free heap and the largest block that can still be allocated are sampled
+ * every second and their minimums kept, and modules that allocate through heap_malloc/heap_free
+ * get their allocations, failures and outstanding bytes counted. A module whose outstanding bytes
+ * keep going up window after window is reported as a leak suspect. All of it is served at
+ * /system/heap and pushed to syslog every flashConfig.syslog_heap_s seconds (0=off).
+ *
+ * Blocks from heap_malloc carry a 4 byte header and must be freed with heap_free, never os_free.
+ */
+#define HEAP_SAMPLE_MS    1000
+#define HEAP_LEAK_WINDOW  60      // samples per leak window
+#define HEAP_LEAK_WINDOWS 5       // windows in a row of growth that make a module a leak suspect
+
+typedef enum {
+  HEAP_HTTPD, HEAP_SERBRIDGE, HEAP_VNC, HEAP_TLV, HEAP_TAP, HEAP_NETBUF, HEAP_POOL,
+  HEAP_MODULES
+} heap_module_t;
+
+typedef struct {
+  uint32_t allocs, frees;
+  uint32_t failed;            // allocations the heap refused
+  uint32_t bytes, max_bytes;  // outstanding
+  uint32_t last_bytes;        // outstanding at the end of the last leak window
+  uint8_t  growing;           // leak windows in a row the outstanding bytes went up
+} heap_mod_stats_t;
+
+typedef struct {
+  uint32_t free, free_min;
+  uint32_t largest, largest_min; // largest block that could be allocated
+} heap_stats_t;
+
+extern heap_stats_t heap_stats;
+
+// start sampling, call once from user_init
+void heapstat_init(void);
+void *heap_malloc(heap_module_t mod, uint16_t size);
+void *heap_zalloc(heap_module_t mod, uint16_t size);
+void heap_free(void *p);
+// like mem_trim on a block from heap_malloc
+void *heap_trim(void *p, uint16_t size);
+const heap_mod_stats_t *heap_mod_stats(heap_module_t mod);
+const char *heap_mod_name(heap_module_t mod);
+bool heap_leak_suspect(heap_module_t mod);
+
+#endif
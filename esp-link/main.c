@@ -18,17 +18,23 @@
 #include "cgitcp.h"
 #include "cgimqtt.h"
 #include "cgiflash.h"
+#include "cgitlv.h"
 // #include "cgioptiboot.h"
 #include "auth.h"
 #include "espfs.h"
 #include "uart.h"
 #include "serbridge.h"
 #include "tlv.h"
+#include "tlvtap.h"
 #include "vncbridge.h"
 #include "status.h"
 #include "serled.h"
 #include "console.h"
 #include "config.h"
+#include "task.h"
+#include "cpuacct.h"
+#include "mempool.h"
+#include "heapstat.h"
 #include "log.h"
 #include "gpio.h"
 #ifdef SYSLOG
@@ -69,6 +75,7 @@ HttpdBuiltInUrl builtInUrls[] = {
   { "/console/baud", ajaxConsoleBaud, NULL },
   { "/console/text", ajaxConsole, NULL },
   { "/console/send", ajaxConsoleSend, NULL },
+  { "/tlv/stats", cgiTlvStats, NULL },
   //Enable the line below to protect the WiFi configuration with an username/password combo.
   //    {"/wifi/*", authBasic, myPassFn},
   { "/wifi", cgiRedirect, "/wifi/wifi.html" },
@@ -83,6 +90,8 @@ HttpdBuiltInUrl builtInUrls[] = {
   { "/wifi/apchange", cgiApSettingsChange, NULL },  
   { "/system/info", cgiSystemInfo, NULL },
   { "/system/update", cgiSystemSet, NULL },
+  { "/system/cpu", cgiSystemCpu, NULL },
+  { "/system/heap", cgiSystemHeap, NULL },
   { "/services/info", cgiServicesInfo, NULL },
   { "/services/update", cgiServicesSet, NULL },
   { "/pins", cgiPins, NULL },
@@ -96,7 +105,9 @@ HttpdBuiltInUrl builtInUrls[] = {
 #ifdef SHOW_HEAP_USE
 static ETSTimer prHeapTimer;
 static void ICACHE_FLASH_ATTR prHeapTimerCb(void *arg) {
-  os_printf("Heap: %ld\n", (unsigned long)system_get_free_heap_size());
+  os_printf("Heap: %ld, min %ld, largest block %ld, min %ld\n",
+      (unsigned long)system_get_free_heap_size(), heap_stats.free_min, heap_stats.largest,
+      heap_stats.largest_min);
 }
 #endif
 
@@ -125,7 +136,10 @@ void user_init(void) {
   gpio_output_set(0, 0, 0, (1<<15)); // some people tie it to GND, gotta ensure it's disabled
   // init UART
   uart_init(flashConfig.baud_rate, 115200);
+  uart0_rx_thresholds(flashConfig.uart_rx_full, flashConfig.uart_rx_tout);
   logInit(); // must come after init of uart
+  mempool_init(); // reserve the buffer pools before anything else carves up the heap
+  heapstat_init();
   // Say hello (leave some time to cause break in TX after boot loader's msg
   os_delay_us(10000L);
   os_printf("\n\n** %s\n", esp_link_version);
@@ -144,6 +158,7 @@ void user_init(void) {
   // init the wifi-serial transparent bridge (port 23)
   serbridgeInit(23);
   vncbridgeInit(5900);
+  tlvTapInit(flashConfig.tlv_tap_port);
 //  uart_add_recv_cb(&serbridgeUartCb);
   uart_add_recv_cb(&tlvUartCb);
   // uart_add_recv_cb(&vncbridgeUartCb);
@@ -171,6 +186,8 @@ void user_init(void) {
 #endif
   NOTICE("initializing user application");
   app_init();
+  stall_probe_init();
+  cpuacct_init();
   NOTICE("Waiting for work to do...");
   uart0_tx_buffer("d41d8cd98f00b204e9800998ecf8427e", 32);
 }
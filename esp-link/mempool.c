@@ -0,0 +1,114 @@
+// Fixed-size block pools, see mempool.h
+
+#include <esp8266.h>
+#include "mempool.h"
+#include "heapstat.h"
+
+typedef struct mempool_block {
+  struct mempool_block *next;
+} mempool_block;
+
+typedef struct {
+  char *base, *end;           // the reserved blocks
+  mempool_block *free;
+} mempool_t;
+
+// size classes, smallest first, sizes a multiple of 4 to keep blocks aligned
+static mempool_stats_t mp_stats[MEMPOOL_CLASSES] = {
+  { .size = 32,   .count = 16 },  // REST header strings and the like
+  { .size = 128,  .count = 16 },  // most MQTT packets and syslog entries
+  { .size = 512,  .count = 8 },
+  { .size = 1280, .count = 2 },   // syslog composition, REST requests
+};
+static mempool_t mp_pools[MEMPOOL_CLASSES];
+
+void ICACHE_FLASH_ATTR mempool_init(void) {
+  for (uint8_t c=0; c<MEMPOOL_CLASSES; c++) {
+    mempool_t *mp = &mp_pools[c];
+    uint16_t size = mp_stats[c].size;
+    mp->base = os_malloc(size * mp_stats[c].count);
+    if (mp->base == NULL) {
+      os_printf("mempool: cannot reserve %d x %d bytes\n", mp_stats[c].count, size);
+      mp_stats[c].count = 0;
+      continue;
+    }
+    mp->end = mp->base + size * mp_stats[c].count;
+    mp->free = NULL;
+    for (char *b = mp->end - size; b >= mp->base; b -= size) {
+      ((mempool_block *)b)->next = mp->free;
+      mp->free = (mempool_block *)b;
+    }
+  }
+}
+
+// take a block of class c, NULL if it's empty
+static void * ICACHE_FLASH_ATTR mempool_take(uint8_t c) {
+  mempool_stats_t *st = &mp_stats[c];
+  mempool_block *b = mp_pools[c].free;
+  if (b == NULL) return NULL;
+  mp_pools[c].free = b->next;
+  st->allocs++;
+  if (++st->in_use > st->max_in_use) st->max_in_use = st->in_use;
+  return b;
+}
+
+void * ICACHE_FLASH_ATTR mempool_alloc(uint16_t size) {
+  uint8_t c;
+  for (c=0; c<MEMPOOL_CLASSES && size > mp_stats[c].size; c++) ;
+  if (c < MEMPOOL_CLASSES) {
+    void *b = mempool_take(c);
+    if (b != NULL) return b;
+  } else {
+    c = MEMPOOL_CLASSES-1; // too big for any class, counted against the largest
+  }
+  mp_stats[c].allocs++;
+  mp_stats[c].exhausted++;
+  return heap_malloc(HEAP_POOL, size);
+}
+
+void * ICACHE_FLASH_ATTR mempool_zalloc(uint16_t size) {
+  void *p = mempool_alloc(size);
+  if (p != NULL) os_memset(p, 0, size);
+  return p;
+}
+
+// the class a block belongs to, MEMPOOL_CLASSES if it came from the heap
+static uint8_t ICACHE_FLASH_ATTR mempool_class(void *p) {
+  uint8_t c;
+  for (c=0; c<MEMPOOL_CLASSES; c++)
+    if ((char *)p >= mp_pools[c].base && (char *)p < mp_pools[c].end) break;
+  return c;
+}
+
+void ICACHE_FLASH_ATTR mempool_free(void *p) {
+  if (p == NULL) return;
+  uint8_t c = mempool_class(p);
+  if (c == MEMPOOL_CLASSES) {
+    heap_free(p);
+    return;
+  }
+  mempool_block *b = p;
+  b->next = mp_pools[c].free;
+  mp_pools[c].free = b;
+  mp_stats[c].in_use--;
+}
+
+void * ICACHE_FLASH_ATTR mempool_trim(void *p, uint16_t size) {
+  uint8_t c = mempool_class(p);
+  if (c == MEMPOOL_CLASSES) return heap_trim(p, size);
+
+  // the smallest class below c that fits and has a free block, else keep what we have
+  for (uint8_t t=0; t<c; t++) {
+    if (size > mp_stats[t].size) continue;
+    void *q = mempool_take(t);
+    if (q == NULL) continue;
+    os_memcpy(q, p, size);
+    mempool_free(p);
+    return q;
+  }
+  return p;
+}
+
+const mempool_stats_t * ICACHE_FLASH_ATTR mempool_stats(uint8_t cls) {
+  return &mp_stats[cls < MEMPOOL_CLASSES ? cls : 0];
+}
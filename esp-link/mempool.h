@@ -0,0 +1,33 @@
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include <esp8266.h>
+
+/* Fixed-size block pools for buffers that are allocated and freed all the time (MQTT packets,
+ * syslog entries, REST requests). Each size class is reserved in one piece at boot so these
+ * buffers no longer fragment the heap; alloc and free are O(1). A request that is larger than
+ * the largest class, or finds its class empty, falls back to the heap (tagged HEAP_POOL in the
+ * heap telemetry) and is counted as exhausted, against the largest class if it was too big for
+ * all of them, so a pool that is too small shows up in the stats instead of failing.
+ */
+#define MEMPOOL_CLASSES 4
+
+typedef struct {
+  uint16_t size;              // block size
+  uint8_t  count;             // blocks reserved
+  uint8_t  in_use, max_in_use;
+  uint32_t allocs;
+  uint32_t exhausted;         // allocations that had to fall back to the heap
+} mempool_stats_t;
+
+// reserve the pools, call once early in user_init
+void mempool_init(void);
+void *mempool_alloc(uint16_t size);
+void *mempool_zalloc(uint16_t size);
+// free a block from mempool_alloc, heap fallbacks go back to the heap
+void mempool_free(void *p);
+// give back what's unused past size, like mem_trim, the block may move to a smaller class
+void *mempool_trim(void *p, uint16_t size);
+const mempool_stats_t *mempool_stats(uint8_t cls);
+
+#endif
@@ -0,0 +1,129 @@
+// Pooled TCP send buffers, see netbuf.h
+
+#include <esp8266.h>
+#include "netbuf.h"
+#include "heapstat.h"
+
+static netbuf *netbuf_free_list;
+netbuf_stats_t netbuf_stats;
+
+netbuf * ICACHE_FLASH_ATTR netbuf_alloc(void) {
+  netbuf *b = netbuf_free_list;
+  if (b != NULL) {
+    netbuf_free_list = b->next;
+  } else if (netbuf_stats.allocated < NETBUF_MAX && (b = heap_malloc(HEAP_NETBUF, sizeof(netbuf))) != NULL) {
+    netbuf_stats.allocated++;
+  } else {
+    netbuf_stats.exhausted++;
+    return NULL;
+  }
+  b->next = NULL;
+  b->start = 0;
+  b->len = 0;
+  b->refs = 1;
+  if (++netbuf_stats.in_use > netbuf_stats.max_in_use) netbuf_stats.max_in_use = netbuf_stats.in_use;
+  return b;
+}
+
+void ICACHE_FLASH_ATTR netbuf_release(netbuf *b) {
+  if (--b->refs != 0) return;
+  b->next = netbuf_free_list;
+  netbuf_free_list = b;
+  netbuf_stats.in_use--;
+}
+
+bool ICACHE_FLASH_ATTR netbuf_available(void) {
+  return netbuf_free_list != NULL || netbuf_stats.allocated < NETBUF_MAX;
+}
+
+void ICACHE_FLASH_ATTR netbuf_overflow(uint32_t *overflow_at, struct espconn *conn, const char *who) {
+  if (*overflow_at) {
+    // we've already been overflowing
+    if (system_get_time() - *overflow_at > 10*1000*1000) {
+      // no progress in 10 seconds, kill the connection
+      os_printf("%s: killing overflowing stuck conn %p\n", who, conn);
+      espconn_disconnect(conn);
+    }
+    // else be silent, we already printed an error
+  } else {
+    // print 1-time message and take timestamp
+    os_printf("%s: send queue full, conn %p\n", who, conn);
+    *overflow_at = system_get_time();
+  }
+}
+
+//===== Send queue
+
+void ICACHE_FLASH_ATTR netq_init(netq_t *q, uint8_t maxbufs) {
+  os_memset(q, 0, sizeof(*q));
+  q->maxbufs = maxbufs;
+}
+
+sint8 ICACHE_FLASH_ATTR netq_append(netq_t *q, struct espconn *conn, const char *data, uint16_t len) {
+  while (len > 0) {
+    if (q->tail == NULL || q->tail->len == NETBUF_SIZE) {
+      netbuf *b = q->nbufs < q->maxbufs ? netbuf_alloc() : NULL;
+      if (b == NULL) {
+        netbuf_overflow(&q->overflow_at, conn, "netq");
+        return -128;
+      }
+      if (q->tail != NULL) q->tail->next = b;
+      else q->head = b;
+      q->tail = b;
+      q->nbufs++;
+    }
+    uint16_t n = NETBUF_SIZE - q->tail->len;
+    if (n > len) n = len;
+    os_memcpy(q->tail->data + q->tail->len, data, n);
+    q->tail->len += n;
+    data += n;
+    len -= n;
+  }
+  return ESPCONN_OK;
+}
+
+uint16_t ICACHE_FLASH_ATTR netq_pending(netq_t *q) {
+  uint16_t n = 0;
+  for (netbuf *b = q->head; b != NULL; b = b->next) n += b->len;
+  return n - q->off - q->sending;
+}
+
+int ICACHE_FLASH_ATTR netq_send(netq_t *q, struct espconn *conn) {
+  if (q->sending != 0 || q->head == NULL) return 0;
+  uint16_t len = q->head->len - q->off;
+  if (len == 0) return 0;
+  sint8 result = espconn_sent(conn, (uint8_t*)q->head->data + q->off, len);
+  if (result != ESPCONN_OK) {
+    os_printf("netq_send: espconn_sent error %d on conn %p\n", result, conn);
+    if (!q->overflow_at) q->overflow_at = system_get_time();
+    return result;
+  }
+  q->sending = len;
+  return len;
+}
+
+void ICACHE_FLASH_ATTR netq_sent(netq_t *q) {
+  q->off += q->sending;
+  q->sending = 0;
+  q->overflow_at = 0;
+  // recycle the head once it has gone out completely
+  if (q->head != NULL && q->off == q->head->len) {
+    netbuf *b = q->head;
+    q->head = b->next;
+    if (q->head == NULL) q->tail = NULL;
+    q->off = 0;
+    q->nbufs--;
+    netbuf_release(b);
+  }
+}
+
+void ICACHE_FLASH_ATTR netq_free(netq_t *q) {
+  while (q->head != NULL) {
+    netbuf *b = q->head;
+    q->head = b->next;
+    netbuf_release(b);
+  }
+  q->tail = NULL;
+  q->off = q->sending = 0;
+  q->nbufs = 0;
+}
@@ -0,0 +1,63 @@
+#ifndef NETBUF_H
+#define NETBUF_H
+
+#include <esp8266.h>
+#include <espconn.h>
+
+/* Send buffers for the TCP servers. Buffers hold one TCP segment and come from a pool that
+ * grows from the heap up to NETBUF_MAX buffers as they're needed and then recycles them, so
+ * once a bridge has warmed up its send path doesn't touch the heap at all.
+ */
+#define NETBUF_SIZE 1460      // one MSS
+#define NETBUF_MAX  12        // the most buffers the pool takes from the heap
+
+typedef struct netbuf {
+  struct netbuf *next;
+  uint32_t start;             // stream offset of data[0], for owners that track one
+  uint16_t len;               // bytes used in data
+  uint8_t  refs;
+  char     data[NETBUF_SIZE];
+} netbuf;
+
+// a buffer with one reference and no data, NULL once the pool is exhausted
+netbuf *netbuf_alloc(void);
+// drop a reference, the buffer goes back to the pool with the last one
+void netbuf_release(netbuf *b);
+// true if the pool has a buffer left to hand out, barring the heap running out
+bool netbuf_available(void);
+
+typedef struct {
+  uint8_t allocated;          // buffers taken from the heap
+  uint8_t in_use, max_in_use;
+  uint32_t exhausted;         // allocations refused because all NETBUF_MAX were in use
+} netbuf_stats_t;
+extern netbuf_stats_t netbuf_stats;
+
+// Per-connection send queue: a chain of buffers of which the head is sent one span at a
+// time, each after the sent callback for the previous one
+typedef struct {
+  netbuf   *head, *tail;
+  uint16_t off;               // bytes of head already sent
+  uint16_t sending;           // bytes handed to espconn_sent, awaiting the sent callback
+  uint8_t  nbufs, maxbufs;
+  uint32_t overflow_at;       // when the queue started to overflow
+} netq_t;
+
+void netq_init(netq_t *q, uint8_t maxbufs);
+// append data, returns ESPCONN_OK or -128 if it didn't all fit (see netbuf_overflow)
+sint8 netq_append(netq_t *q, struct espconn *conn, const char *data, uint16_t len);
+// bytes queued and not yet handed to espconn
+uint16_t netq_pending(netq_t *q);
+// hand the next span to espconn_sent unless a send is in flight, returns the bytes sent, 0 if
+// nothing was sent or the espconn_sent error
+int netq_send(netq_t *q, struct espconn *conn);
+// call from the sent callback
+void netq_sent(netq_t *q);
+// return all buffers to the pool
+void netq_free(netq_t *q);
+
+// Overflow policy shared by the servers: print once when a connection starts to overflow and
+// disconnect it if it hasn't made progress 10 seconds later
+void netbuf_overflow(uint32_t *overflow_at, struct espconn *conn, const char *who);
+
+#endif
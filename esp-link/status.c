@@ -8,6 +8,7 @@
 #ifdef MQTT
 #include "mqtt.h"
 #include "mqtt_client.h"
+#include "cgitlv.h"
 extern MQTT_Client mqttClient;
 
 //===== MQTT Status update
@@ -38,6 +39,16 @@ static void ICACHE_FLASH_ATTR mqttStatusCb(void *v) {
   char buf[128];
   mqttStatusMsg(buf);
   MQTT_Publish(&mqttClient, flashConfig.mqtt_status_topic, buf, os_strlen(buf), 1, 0);
+
+  if (flashConfig.mqtt_tlv_stats) {
+    char topic[sizeof(flashConfig.mqtt_status_topic)+4];
+    os_sprintf(topic, "%s/tlv", flashConfig.mqtt_status_topic);
+    char *stats = os_malloc(2048);
+    if (stats == NULL) return;
+    int len = tlvStatsJson(stats, 2048);
+    MQTT_Publish(&mqttClient, topic, stats, len, 1, 0);
+    os_free(stats);
+  }
 }
 
 
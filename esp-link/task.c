@@ -12,6 +12,7 @@
 
 #include "esp8266.h"
 #include <task.h>
+#include "cpuacct.h"
 
 #define MAXUSRTASKS	 8
 
@@ -21,58 +22,134 @@
 #define DBG_USRTASK(format, ...) do { } while(0)
 #endif
 
-LOCAL os_event_t *_task_queue   = NULL;		// system_os_task queue
-LOCAL os_task_t  *usr_task_queue = NULL;	// user task queue
+// Each priority gets its own system_os_task queue. A task sits in its queue at most once: a post
+// while it is still pending is coalesced, so a queue never needs more than MAXUSRTASKS slots.
+typedef struct {
+  os_task_t     fn;
+  uint8_t       prio;
+  volatile bool posted;   // in the queue and not yet run
+  cpuacct_t     acct;
+} usr_task_t;
+
+LOCAL os_event_t *_task_queue[USR_TASK_PRIOS];	// system_os_task queues
+LOCAL usr_task_t usr_tasks[MAXUSRTASKS];		// user tasks
+LOCAL usr_task_stats_t usr_stats[USR_TASK_PRIOS];
 
 // it seems save to run the usr_event_handler from RAM, so no ICACHE_FLASH_ATTR here...
 
 LOCAL void usr_event_handler(os_event_t *e)
 {
   DBG_USRTASK("usr_event_handler: event %p (sig=%d, par=%p)\n", e, (int)e->sig, (void *)e->par);
-  if (usr_task_queue[e->sig] == NULL || e->sig < 0 || e->sig >= MAXUSRTASKS) {
+  if (e->sig < 0 || e->sig >= MAXUSRTASKS || usr_tasks[e->sig].fn == NULL) {
     os_printf("usr_event_handler: task %d %s\n", (int)e->sig,
-	       usr_task_queue[e->sig] == NULL ? "not registered" : "out of range");
+	       e->sig < 0 || e->sig >= MAXUSRTASKS ? "out of range" : "not registered");
     return;
   }
-  (usr_task_queue[e->sig])(e);
+  usr_task_t *t = &usr_tasks[e->sig];
+  uint32_t ps = intr_lock();
+  usr_stats[t->prio].depth--;
+  t->posted = false;	// posts from here on queue it again
+  intr_unlock(ps);
+  uint32_t start = cpuacct_ccount();
+  (t->fn)(e);
+  cpuacct_add(&t->acct, cpuacct_ccount() - start);
 }
 
 LOCAL void init_usr_task() {
-  if (_task_queue == NULL)
-    _task_queue = (os_event_t *)os_zalloc(sizeof(os_event_t) * _task_queueLen);
-
-  if (usr_task_queue == NULL)
-    usr_task_queue = (os_task_t *)os_zalloc(sizeof(os_task_t) * MAXUSRTASKS);
-
-  system_os_task(usr_event_handler, _taskPrio, _task_queue, _task_queueLen);
+  for (uint8_t prio = 0; prio < USR_TASK_PRIOS; prio++) {
+    _task_queue[prio] = (os_event_t *)os_zalloc(sizeof(os_event_t) * MAXUSRTASKS);
+    system_os_task(usr_event_handler, prio, _task_queue[prio], MAXUSRTASKS);
+  }
 }
 
 // public functions
+
+// also called from the uart interrupt handler, hence the level restoring lock
 bool post_usr_task(uint8_t task, os_param_t par)
 {
-  return system_os_post(_taskPrio, task, par);
+  if (task >= MAXUSRTASKS || usr_tasks[task].fn == NULL) return false;
+  usr_task_t *t = &usr_tasks[task];
+  usr_task_stats_t *st = &usr_stats[t->prio];
+  bool ok = true;
+
+  uint32_t ps = intr_lock();
+  st->posts++;
+  if (t->posted) {
+    st->coalesced++;	// still pending, it will see whatever this post was about
+  } else if (system_os_post(t->prio, task, par)) {
+    t->posted = true;
+    if (++st->depth > st->high_water) st->high_water = st->depth;
+  } else {
+    st->dropped++;
+    ok = false;
+  }
+  intr_unlock(ps);
+  return ok;
 }
 
-uint8_t register_usr_task (os_task_t event)
+uint8_t register_usr_task_prio(os_task_t event, uint8_t prio, const char *name)
 {
   int task;
 
-  DBG_USRTASK("register_usr_task: %p\n", event);
-  if (_task_queue   == NULL || usr_task_queue == NULL)
+  DBG_USRTASK("register_usr_task: %p prio %d\n", event, prio);
+  if (_task_queue[0] == NULL)
     init_usr_task();
+  if (prio >= USR_TASK_PRIOS) prio = USR_TASK_PRIOS-1;
 
   for (task = 0; task < MAXUSRTASKS; task++) {
-    if (usr_task_queue[task] == event)
+    if (usr_tasks[task].fn == event)
       return task;		// task already registered - bail out...
   }
 
   for (task = 0; task < MAXUSRTASKS; task++) {
-    if (usr_task_queue[task] == NULL) {
+    if (usr_tasks[task].fn == NULL) {
       DBG_USRTASK("register_usr_task: assign task #%d\n", task);
-      usr_task_queue[task] = event;
+      usr_tasks[task].prio = prio;
+      usr_tasks[task].acct.name = name != NULL ? name : "task";
+      usr_tasks[task].fn = event;
       break;
     }
   }
   return task;
 }
 
+uint8_t register_usr_task(os_task_t event)
+{
+  return register_usr_task_prio(event, _taskPrio, NULL);
+}
+
+const usr_task_stats_t *usr_task_stats(uint8_t prio)
+{
+  return &usr_stats[prio < USR_TASK_PRIOS ? prio : 0];
+}
+
+// Event loop stall probe: a timer posts the probe task every STALL_PROBE_MS with the time it did
+// so, the delay until the task runs is how long other handlers kept the loop busy
+#define STALL_PROBE_MS 20
+static ETSTimer stall_probe_timer;
+static uint8_t stall_probe_task;
+static uint32_t stall_max;
+
+LOCAL void stall_probe_run(os_event_t *e)
+{
+  uint32_t stall = system_get_time() - (uint32_t)e->par;
+  if (stall > stall_max) stall_max = stall;
+}
+
+LOCAL void stall_probe_post(void *arg)
+{
+  post_usr_task(stall_probe_task, system_get_time());
+}
+
+void stall_probe_init(void)
+{
+  stall_probe_task = register_usr_task_prio(stall_probe_run, USR_TASK_PRIO_BULK, "stall probe");
+  os_timer_disarm(&stall_probe_timer);
+  os_timer_setfn(&stall_probe_timer, stall_probe_post, NULL);
+  os_timer_arm(&stall_probe_timer, STALL_PROBE_MS, 1);
+}
+
+uint32_t stall_probe_max(void)
+{
+  return stall_max;
+}
@@ -11,10 +11,43 @@
 #ifndef	USRTASK_H
 #define USRTASK_H
 
-#define _taskPrio        1
-#define _task_queueLen  64
+// Task priorities, higher runs first. system_os_task has three user levels.
+#define USR_TASK_PRIO_UART  2	// UART receive, the MCU link must never back up
+#define USR_TASK_PRIO_HID   1	// VNC input, latency is what the user sees
+#define USR_TASK_PRIO_BULK  0	// serial bridge, syslog and anything that can wait
+#define USR_TASK_PRIOS      3
+#define _taskPrio        USR_TASK_PRIO_HID
 
 uint8_t register_usr_task (os_task_t event);
+// name labels the task in the CPU accounting, see cpuacct.h
+uint8_t register_usr_task_prio(os_task_t event, uint8_t prio, const char *name);
+// queue a task, a post while it's still pending is coalesced, false if the queue was full;
+// may be called from interrupt handlers
 bool	post_usr_task(uint8_t task, os_param_t par);
 
+// Interrupt lock that puts the previous interrupt level back on unlock. ETS_INTR_UNLOCK always
+// drops to level 0, which re-enables interrupts in the middle of an interrupt handler or of an
+// outer lock, so code that can run there has to use this instead.
+static inline uint32_t intr_lock(void) {
+  uint32_t ps;
+  __asm__ __volatile__("rsil %0, 3" : "=a"(ps) :: "memory");
+  return ps;
+}
+static inline void intr_unlock(uint32_t ps) {
+  __asm__ __volatile__("wsr %0, ps; rsync" :: "a"(ps) : "memory");
+}
+
+// per priority counters
+typedef struct {
+  uint8_t  depth, high_water;	// tasks in the queue now and at most
+  uint32_t posts;
+  uint32_t coalesced;		// posts merged into one that was still pending
+  uint32_t dropped;		// posts lost because the queue was full
+} usr_task_stats_t;
+const usr_task_stats_t *usr_task_stats(uint8_t prio);
+
+// Measure how long posted tasks wait to run, stall_probe_max returns the worst case in us
+void stall_probe_init(void);
+uint32_t stall_probe_max(void);
+
 #endif
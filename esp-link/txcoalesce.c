@@ -0,0 +1,75 @@
+// TCP send coalescing, see txcoalesce.h
+
+#include <esp8266.h>
+#include "txcoalesce.h"
+
+static void ICACHE_FLASH_ATTR txcoalesce_timer_cb(void *arg) {
+  txcoalesce_t *tc = arg;
+  tc->armed = false;
+  tc->due = true;
+  tc->flush(tc->arg);
+}
+
+void ICACHE_FLASH_ATTR txcoalesce_init(txcoalesce_t *tc, uint8_t mode, uint16_t delay_us,
+    uint16_t bytes, txc_stats_t *stats, ETSTimerFunc *flush, void *arg) {
+  os_timer_disarm(&tc->timer);
+  tc->mode = mode;
+  tc->delay_us = delay_us;
+  tc->bytes = bytes;
+  if (mode == TXC_BYTES && delay_us == 0) tc->delay_us = TXC_BYTES_MAX_US;
+  tc->first_at = 0;
+  tc->win_start = system_get_time();
+  tc->win_segs = 0;
+  tc->armed = tc->due = false;
+  tc->flush = flush;
+  tc->arg = arg;
+  tc->stats = stats;
+  os_timer_setfn(&tc->timer, txcoalesce_timer_cb, tc);
+}
+
+bool ICACHE_FLASH_ATTR txcoalesce_ready(txcoalesce_t *tc, uint16_t pending, uint16_t capacity) {
+  if (pending == 0) return false;
+  if (tc->mode == TXC_IMMEDIATE) return true;
+
+  uint32_t now = system_get_time();
+  if (tc->first_at == 0) tc->first_at = now;
+  uint32_t held = now - tc->first_at;
+  bool due = tc->due || held >= tc->delay_us || pending >= capacity ||
+    (tc->mode == TXC_BYTES && pending >= tc->bytes);
+  if (!due) {
+    if (!tc->armed) {
+      os_timer_arm(&tc->timer, (tc->delay_us - held + 999) / 1000, 0);
+      tc->armed = true;
+    }
+    return false;
+  }
+
+  if (tc->armed) os_timer_disarm(&tc->timer);
+  tc->armed = tc->due = false;
+  tc->first_at = 0;
+  txc_stats_t *s = tc->stats;
+  s->batches++;
+  s->hold_total_us += held;
+  if (held > s->hold_max_us) s->hold_max_us = held;
+  return true;
+}
+
+void ICACHE_FLASH_ATTR txcoalesce_sent(txcoalesce_t *tc, uint16_t len) {
+  txc_stats_t *s = tc->stats;
+  s->segments++;
+  s->bytes += len;
+  uint32_t now = system_get_time();
+  if (now - tc->win_start >= 1000000) {
+    // a window with no sends at all in the last second means the rate dropped to 0
+    s->seg_rate = now - tc->win_start < 2000000 ? tc->win_segs : 0;
+    tc->win_start = now;
+    tc->win_segs = 0;
+  }
+  tc->win_segs++;
+}
+
+void ICACHE_FLASH_ATTR txcoalesce_stop(txcoalesce_t *tc) {
+  os_timer_disarm(&tc->timer);
+  tc->armed = tc->due = false;
+  tc->first_at = 0;
+}
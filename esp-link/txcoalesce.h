@@ -0,0 +1,49 @@
+#ifndef TXCOALESCE_H
+#define TXCOALESCE_H
+
+#include <esp8266.h>
+
+/* Send coalescing for the TCP bridges. Small chunks from the MCU are held back so that they
+ * leave in fewer, larger TCP segments:
+ *   TXC_IMMEDIATE  send as soon as the previous send has completed (the original behaviour)
+ *   TXC_DELAY      hold data for up to delay_us after the first byte arrives
+ *   TXC_BYTES      hold data until bytes have gathered, but no longer than delay_us (or
+ *                  TXC_BYTES_MAX_US if that is 0) so a trailing partial chunk isn't stuck
+ * The timer has millisecond resolution, delays are rounded up to the next millisecond.
+ */
+#define TXC_IMMEDIATE 0
+#define TXC_DELAY     1
+#define TXC_BYTES     2
+#define TXC_BYTES_MAX_US 20000
+
+typedef struct {
+  uint32_t segments;          // sends handed to espconn
+  uint32_t bytes;
+  uint32_t seg_rate;          // segments sent during the last full second
+  uint32_t hold_total_us;     // time data was held back, summed over the batches
+  uint32_t hold_max_us;
+  uint32_t batches;           // times held data was released
+} txc_stats_t;
+
+typedef struct {
+  uint8_t mode;
+  uint16_t delay_us, bytes;
+  uint32_t first_at;          // system_get_time() when the oldest unsent byte arrived, 0 if none
+  uint32_t win_start, win_segs;
+  bool armed, due;
+  ETSTimer timer;             // calls flush(arg) once held data is due
+  ETSTimerFunc *flush;
+  void *arg;
+  txc_stats_t *stats;         // shared by all connections of a port
+} txcoalesce_t;
+
+void txcoalesce_init(txcoalesce_t *tc, uint8_t mode, uint16_t delay_us, uint16_t bytes,
+    txc_stats_t *stats, ETSTimerFunc *flush, void *arg);
+// pending bytes are waiting and the connection can send, returns true if they should go now,
+// else the flush function gets called when they're due
+bool txcoalesce_ready(txcoalesce_t *tc, uint16_t pending, uint16_t capacity);
+// account a send of len bytes handed to espconn
+void txcoalesce_sent(txcoalesce_t *tc, uint16_t len);
+void txcoalesce_stop(txcoalesce_t *tc);
+
+#endif
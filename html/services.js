@@ -50,10 +50,16 @@ function displayServices(data) {
   $("#syslog-spinner").setAttribute("hidden", "");
   $("#sntp-spinner").setAttribute("hidden", "");
   $("#mdns-spinner").setAttribute("hidden", "");
+  $("#vnc-spinner").setAttribute("hidden", "");
+  $("#tap-spinner").setAttribute("hidden", "");
+  $("#txc-spinner").setAttribute("hidden", "");
 
   $("#Syslog-form").removeAttribute("hidden");
   $("#SNTP-form").removeAttribute("hidden");
   $("#mDNS-form").removeAttribute("hidden");
+  $("#VNC-form").removeAttribute("hidden");
+  $("#Tap-form").removeAttribute("hidden");
+  $("#Coalescing-form").removeAttribute("hidden");
 
   var i, inputs = $("input");
   for (i = 0; i < inputs.length; i++) {
@@ -16,6 +16,8 @@ Esp8266 http server - core routines
 
 #include <esp8266.h>
 #include "httpd.h"
+#include "cpuacct.h"
+#include "heapstat.h"
 
 #ifdef HTTPD_DBG
 #define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
@@ -128,7 +130,7 @@ static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdConnData *conn) {
 
   conn->conn = NULL; // don't try to send anything, the SDK crashes...
   if (conn->cgi != NULL) conn->cgi(conn); // free cgi data
-  if (conn->post->buff != NULL) os_free(conn->post->buff);
+  if (conn->post->buff != NULL) heap_free(conn->post->buff);
   conn->cgi = NULL;
   conn->post->buff = NULL;
 }
@@ -459,7 +461,7 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
       conn->post->buffSize = conn->post->len;
     }
     //DBG("Mallocced buffer for %d + 1 bytes of post data.\n", conn->post->buffSize);
-    conn->post->buff = (char*)os_malloc(conn->post->buffSize + 1);
+    conn->post->buff = (char*)heap_malloc(HEAP_HTTPD, conn->post->buffSize + 1);
     conn->post->buffLen = 0;
   }
   else if (os_strncmp(h, "Content-Type: ", 14) == 0) {
@@ -555,6 +557,9 @@ static void ICACHE_FLASH_ATTR httpdReconCb(void *arg, sint8 err) {
 }
 
 
+CPUACCT_RECV(httpdRecvCb, "httpd recv")
+CPUACCT_CB(httpdSentCb, "httpd sent")
+
 static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
   debugConn(arg, "httpdConnectCb");
   struct espconn *conn = arg;
@@ -590,10 +595,10 @@ static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
   connData[i].post->len = -1;
   connData[i].startTime = system_get_time();
 
-  espconn_regist_recvcb(conn, httpdRecvCb);
+  espconn_regist_recvcb(conn, httpdRecvCb_acct);
   espconn_regist_reconcb(conn, httpdReconCb);
   espconn_regist_disconcb(conn, httpdDisconCb);
-  espconn_regist_sentcb(conn, httpdSentCb);
+  espconn_regist_sentcb(conn, httpdSentCb_acct);
 
   espconn_set_opt(conn, ESPCONN_REUSEADDR | ESPCONN_NODELAY);
 }
@@ -40,6 +40,7 @@
 #include <esp8266.h>
 #include "pktbuf.h"
 #include "mqtt.h"
+#include "cpuacct.h"
 
 #ifdef MQTT_DBG
 #define DBG_MQTT(format, ...) os_printf(format, ## __VA_ARGS__)
@@ -272,7 +273,7 @@ mqtt_tcpclient_sent_cb(void* arg) {
   if (client->sending_buffer != NULL) {
     PktBuf *buf = client->sending_buffer;
     //DBG_MQTT("PktBuf free %p l=%d\n", buf, buf->filled);
-    os_free(buf);
+    PktBuf_Free(buf);
     client->sending_buffer = NULL;
   }
   client->sending = false;
@@ -397,6 +398,9 @@ mqtt_tcpclient_recon_cb(void* arg, int8_t err) {
 * @param  arg: contain the ip link information
 * @retval None
 */
+CPUACCT_RECV(mqtt_tcpclient_recv, "mqtt recv")
+CPUACCT_CB(mqtt_tcpclient_sent_cb, "mqtt sent")
+
 static void ICACHE_FLASH_ATTR
 mqtt_tcpclient_connect_cb(void* arg) {
   struct espconn* pCon = (struct espconn *)arg;
@@ -404,8 +408,8 @@ mqtt_tcpclient_connect_cb(void* arg) {
   if (client == NULL) return; // aborted connection
 
   espconn_regist_disconcb(client->pCon, mqtt_tcpclient_discon_cb);
-  espconn_regist_recvcb(client->pCon, mqtt_tcpclient_recv);
-  espconn_regist_sentcb(client->pCon, mqtt_tcpclient_sent_cb);
+  espconn_regist_recvcb(client->pCon, mqtt_tcpclient_recv_acct);
+  espconn_regist_sentcb(client->pCon, mqtt_tcpclient_sent_cb_acct);
   os_printf("MQTT: TCP connected to %s:%d\n", client->host, client->port);
 
   // send MQTT connect message to broker
@@ -566,7 +570,7 @@ MQTT_Publish(MQTT_Client* client, const char* topic, const char* data, uint16_t
   uint16_t msg_id;
   if (!mqtt_msg_publish(&msg, topic, data, data_length, qos, retain, &msg_id)){
     os_printf("MQTT ERROR: Queuing Publish failed\n");
-    os_free(buf);
+    PktBuf_Free(buf);
     return FALSE;
   }
   client->mqtt_connection.message_id = msg.message_id;
@@ -743,7 +747,7 @@ mqtt_doAbort(MQTT_Client* client) {
   if (client->cmdDisconnectedCb) client->cmdDisconnectedCb(client);
 
   if (client->sending_buffer != NULL) {
-    os_free(client->sending_buffer);
+    PktBuf_Free(client->sending_buffer);
     client->sending_buffer = NULL;
   }
   client->pCon = NULL;         // it will be freed in disconnect callback
@@ -2,6 +2,7 @@
 
 #include <esp8266.h>
 #include "pktbuf.h"
+#include "mempool.h"
 
 #ifdef PKTBUF_DBG
 //static void ICACHE_FLASH_ATTR
@@ -21,7 +22,7 @@
 
 PktBuf * ICACHE_FLASH_ATTR
 PktBuf_New(uint16_t length) {
-  PktBuf *buf = os_zalloc(length+sizeof(PktBuf));
+  PktBuf *buf = mempool_zalloc(length+sizeof(PktBuf));
   buf->next = NULL;
   buf->filled = 0;
   //os_printf("PktBuf_New: %p l=%d->%d d=%p\n",
@@ -61,6 +62,11 @@ PktBuf * ICACHE_FLASH_ATTR
 PktBuf_ShiftFree(PktBuf *headBuf) {
   PktBuf *buf = headBuf->next;
   //os_printf("PktBuf_ShiftFree: (%p)->%p\n", headBuf, buf);
-  os_free(headBuf);
+  mempool_free(headBuf);
   return buf;
 }
+
+void ICACHE_FLASH_ATTR
+PktBuf_Free(PktBuf *buf) {
+  mempool_free(buf);
+}
@@ -24,4 +24,7 @@ PktBuf *PktBuf_Shift(PktBuf *headBuf);
 // Shift first buffer off queue, free it, return new head
 PktBuf *PktBuf_ShiftFree(PktBuf *headBuf);
 
+// Free a single buffer that is not on a queue
+void PktBuf_Free(PktBuf *buf);
+
 #endif
@@ -7,6 +7,7 @@
 #include "ip_addr.h"
 #include "rest.h"
 #include "cmd.h"
+#include "mempool.h"
 
 #ifdef REST_DBG
 #define DBG_REST(format, ...) os_printf(format, ## __VA_ARGS__)
@@ -128,7 +129,7 @@ tcpclient_sent_cb(void *arg) {
     client->data_sent = client->data_len;
   } else {
     // we're done sending, free the memory
-    if (client->data) os_free(client->data);
+    if (client->data) mempool_free(client->data);
     client->data = 0;
   }
 }
@@ -138,7 +139,7 @@ tcpclient_discon_cb(void *arg) {
   struct espconn *pespconn = (struct espconn *)arg;
   RestClient* client = (RestClient *)pespconn->reverse;
   // free the data buffer, if we have one
-  if (client->data) os_free(client->data);
+  if (client->data) mempool_free(client->data);
   client->data = 0;
 }
 
@@ -148,7 +149,7 @@ tcpclient_recon_cb(void *arg, sint8 errType) {
   RestClient* client = (RestClient *)pCon->reverse;
   os_printf("REST #%d: conn reset, err=%d\n", client-restClient, errType);
   // free the data buffer, if we have one
-  if (client->data) os_free(client->data);
+  if (client->data) mempool_free(client->data);
   client->data = 0;
 }
 
@@ -243,10 +244,10 @@ REST_Setup(CmdPacket *cmd) {
   restNum = (restNum+1)%MAX_REST;
 
   // free any data structure that may be left from a previous connection
-  if (client->header) os_free(client->header);
-  if (client->content_type) os_free(client->content_type);
-  if (client->user_agent) os_free(client->user_agent);
-  if (client->data) os_free(client->data);
+  if (client->header) mempool_free(client->header);
+  if (client->content_type) mempool_free(client->content_type);
+  if (client->user_agent) mempool_free(client->user_agent);
+  if (client->data) mempool_free(client->data);
   if (client->pCon) {
     if (client->pCon->proto.tcp) os_free(client->pCon->proto.tcp);
     os_free(client->pCon);
@@ -260,13 +261,13 @@ REST_Setup(CmdPacket *cmd) {
   client->port = port;
   client->security = security;
 
-  client->header = (char*)os_zalloc(4);
+  client->header = (char*)mempool_zalloc(4);
   client->header[0] = 0;
 
-  client->content_type = (char*)os_zalloc(22);
+  client->content_type = (char*)mempool_zalloc(22);
   os_sprintf((char *)client->content_type, "x-www-form-urlencoded");
 
-  client->user_agent = (char*)os_zalloc(9);
+  client->user_agent = (char*)mempool_zalloc(9);
   os_sprintf((char *)client->user_agent, "esp-link");
 
   client->pCon = (struct espconn *)os_zalloc(sizeof(struct espconn));
@@ -309,8 +310,8 @@ REST_SetHeader(CmdPacket *cmd) {
   if (len > 256) return; //safety check
   switch(header_index) {
   case HEADER_GENERIC:
-    if(client->header) os_free(client->header);
-    client->header = (char*)os_zalloc(len + 3);
+    if(client->header) mempool_free(client->header);
+    client->header = (char*)mempool_zalloc(len + 3);
     cmdPopArg(&req, (uint8_t*)client->header, len);
     client->header[len] = '\r';
     client->header[len+1] = '\n';
@@ -318,8 +319,8 @@ REST_SetHeader(CmdPacket *cmd) {
     DBG_REST("REST: Set header: %s\r\n", client->header);
     break;
   case HEADER_CONTENT_TYPE:
-    if(client->content_type) os_free(client->content_type);
-    client->content_type = (char*)os_zalloc(len + 3);
+    if(client->content_type) mempool_free(client->content_type);
+    client->content_type = (char*)mempool_zalloc(len + 3);
     cmdPopArg(&req, (uint8_t*)client->content_type, len);
     client->content_type[len] = '\r';
     client->content_type[len+1] = '\n';
@@ -327,8 +328,8 @@ REST_SetHeader(CmdPacket *cmd) {
     DBG_REST("REST: Set content_type: %s\r\n", client->content_type);
     break;
   case HEADER_USER_AGENT:
-    if(client->user_agent) os_free(client->user_agent);
-    client->user_agent = (char*)os_zalloc(len + 3);
+    if(client->user_agent) mempool_free(client->user_agent);
+    client->user_agent = (char*)mempool_zalloc(len + 3);
     cmdPopArg(&req, (uint8_t*)client->user_agent, len);
     client->user_agent[len] = '\r';
     client->user_agent[len+1] = '\n';
@@ -390,8 +391,8 @@ REST_Request(CmdPacket *cmd) {
   uint16_t headerLen = strlen(headerFmt) + strlen(method) + strlen(path) + strlen(client->host) +
       strlen(client->header) + strlen(client->content_type) + strlen(client->user_agent);
   DBG_REST(" hdrLen=%d", headerLen);
-  if (client->data) os_free(client->data);
-  client->data = (char*)os_zalloc(headerLen + realLen);
+  if (client->data) mempool_free(client->data);
+  client->data = (char*)mempool_zalloc(headerLen + realLen);
   if (client->data == NULL) goto fail;
   DBG_REST(" totLen=%ld data=%p", headerLen + realLen, client->data);
   client->data_len = os_sprintf((char*)client->data, headerFmt, method, path, client->host,
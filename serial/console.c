@@ -76,8 +76,26 @@ ajaxConsoleBaud(HttpdConnData *connData) {
     status = 200;
   }
 
+  // rx interrupt thresholds, trade latency against interrupt rate at high baud rates; values
+  // the uart would clamp are refused so the config never shows one that isn't in effect
+  uint8_t rxfull = flashConfig.uart_rx_full, rxtout = flashConfig.uart_rx_tout;
+  int8_t full = getUInt8Arg(connData, "rxfull", &rxfull);
+  int8_t tout = getUInt8Arg(connData, "rxtout", &rxtout);
+  if (full < 0 || tout < 0) return HTTPD_CGI_DONE;
+  if (full > 0 || tout > 0) {
+    if (rxfull > UART0_RX_FULL_MAX || rxtout > UART0_RX_TOUT_MAX) {
+      status = 400;
+    } else {
+      flashConfig.uart_rx_full = rxfull;
+      flashConfig.uart_rx_tout = rxtout;
+      uart0_rx_thresholds(rxfull, rxtout);
+      status = configSave() ? 200 : 400;
+    }
+  }
+
   jsonHeader(connData, status);
-  os_sprintf(buff, "{\"rate\": %ld}", flashConfig.baud_rate);
+  os_sprintf(buff, "{\"rate\": %ld, \"rxfull\": %d, \"rxtout\": %d}", flashConfig.baud_rate,
+      flashConfig.uart_rx_full, flashConfig.uart_rx_tout);
   httpdSend(connData, buff, -1);
   return HTTPD_CGI_DONE;
 }
@@ -90,8 +108,7 @@ ajaxConsoleSend(HttpdConnData *connData) {
 
   // figure out where to start in buffer based on URI param
   len = httpdFindArg(connData->getArgs, "text", buff, sizeof(buff));
-  if (len > 0 && len < TLV_MAX_PACKET) {
-    tlv_send(TLV_PIPE, buff, len);
+  if (len > 0 && len <= TLV_MAX_LARGE && tlv_send_large(TLV_PIPE, buff, len) == 0) {
     status = 200;
   }
 
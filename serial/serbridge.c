@@ -17,6 +17,9 @@
 #endif
 #include "tlv.h"
 #include "task.h"
+#include "txcoalesce.h"
+#include "cpuacct.h"
+#include "heapstat.h"
 
 // #define SERBR_DBG
 #ifdef SERBR_DBG
@@ -35,18 +38,22 @@ static esp_tcp serbridgeTcp1;
 // Connection pool
 serbridgeConnData connData[MAX_CONN];
 
+// Hand the oldest contiguous span of the rx ring to the TLV link, tlv_send_large copies it so
+// the span is released right away and nothing in the ring ever moves
 static void ICACHE_FLASH_ATTR
 serbridgeProcessRX(serbridgeConnData *conn)
 {
-
-  if (conn->rxbuffer != NULL && conn->rxbufferlen > 0) {
-    uint8_t len = conn->rxbufferlen > TLV_MAX_PACKET ? TLV_MAX_PACKET : conn->rxbufferlen;
-    if (tlv_send(TLV_PIPE, conn->rxbuffer, len) == 0) {
-      os_memcpy(conn->rxbuffer, conn->rxbuffer+len, conn->rxbufferlen-len);
-      conn->rxbufferlen -= len;
-    }
+  while (conn->rxbuffer != NULL && conn->rxbufferlen > 0) {
+    uint16_t len = MAX_RXBUFFER - conn->rxtail;
+    if (len > conn->rxbufferlen) len = conn->rxbufferlen;
+    if (len > TLV_MAX_LARGE) len = TLV_MAX_LARGE;
+    if (tlv_send_large(TLV_PIPE, conn->rxbuffer + conn->rxtail, len) != 0)
+      break;
+    conn->rxbufferlen -= len;
+    conn->rxtail += len;
+    if (conn->rxtail == MAX_RXBUFFER || conn->rxbufferlen == 0)
+      conn->rxtail = 0;
   }
-
 }
 
 static void ICACHE_FLASH_ATTR
@@ -60,18 +67,19 @@ deferredTask(os_event_t *events)
     if (connData[c].rxbufferlen > 0) {
       serbridgeProcessRX(&connData[c]);
     }
-    if (connData[c].conn != NULL && connData[c].rxbufferlen < 32) {
+    if (connData[c].conn != NULL && connData[c].rxheld && connData[c].rxbufferlen < RX_UNHOLD_MARK) {
       espconn_recv_unhold(connData[c].conn);
+      connData[c].rxheld = false;
     } else if (connData[c].conn == NULL && connData[c].rxbuffer != NULL && connData[c].rxbufferlen == 0) {
       DBG("Freed RX buffer\n");
-      os_free(connData[c].rxbuffer);
+      heap_free(connData[c].rxbuffer);
       connData[c].rxbuffer = NULL;
     }
     if (connData[c].rxbufferlen > 0)
       more = true;
   }
-  if (more) // data awaits, schedule it ourselves
-    post_usr_task(deferredTaskNum, 0);
+  if (more) // data awaits, runs again now or once TLV can take it
+    tlv_reschedule(TLV_PIPE);
 }
 
 // Receive callback
@@ -85,96 +93,175 @@ serbridgeRecvCb(void *arg, char *data, unsigned short len)
     espconn_disconnect(conn->conn);
     return;
   }
-  sint8_t res = espconn_recv_hold(conn->conn);
-  if (res != 0) os_printf("Hold %d\n", res);
-  if (conn->rxbuffer != NULL) {
-    os_memcpy(conn->rxbuffer + conn->rxbufferlen, data, len);
-  } else {
-    DBG("Serial receive buffer is NULL!\n");
+  if (conn->rxbuffer == NULL) {
+    conn->rxbuffer = heap_malloc(HEAP_SERBRIDGE, MAX_RXBUFFER);
+    conn->rxbufferlen = conn->rxtail = 0;
+    if (conn->rxbuffer == NULL) {
+      os_printf("Out of memory for RX buffer\n");
+      espconn_disconnect(conn->conn);
+      return;
+    }
+    DBG("SerConn: RX at %p\n", conn->rxbuffer);
   }
+  // append at the head of the ring, wrapping around at most once
+  uint16_t head = conn->rxtail + conn->rxbufferlen;
+  if (head >= MAX_RXBUFFER) head -= MAX_RXBUFFER;
+  uint16_t first = MAX_RXBUFFER - head;
+  if (first > len) first = len;
+  os_memcpy(conn->rxbuffer + head, data, first);
+  os_memcpy(conn->rxbuffer, data + first, len - first);
   conn->rxbufferlen += len;
-  os_printf("RX Buffer now %d\n", conn->rxbufferlen);
+  DBG("RX Buffer now %d\n", conn->rxbufferlen);
+
+  if (!conn->rxheld && conn->rxbufferlen > RX_HOLD_MARK) {
+    sint8_t res = espconn_recv_hold(conn->conn);
+    if (res != 0) os_printf("Hold %d\n", res);
+    conn->rxheld = true;
+  }
   post_usr_task(deferredTaskNum, 0);
 }
 
 //===== UART -> TCP
 
-// Send all data in conn->txbuffer
-// returns result from espconn_sent if data in buffer or ESPCONN_OK (0)
-// Use only internally from espbuffsend and serbridgeSentCb
-static sint8 ICACHE_FLASH_ATTR
-sendtxbuffer(serbridgeConnData *conn)
+// Data from the MCU is stored once, in a chain of netbufs that all connections read from. Each
+// connection has a cursor into the chain and a chunk goes back to the pool when the last
+// connection has sent it, so every additional client costs a cursor rather than a buffer.
+static netbuf *txtail;           // newest chunk, data from the MCU is appended to it
+static uint8_t txclients;        // connections reading from the chain
+static uint32_t txreleased;      // stream offset up to which the coalescing policy lets data go
+static bool txbusy;              // a PIPE frame was refused for lack of chunks
+static txcoalesce_t txcoalesce;
+txc_stats_t serbridgeTxStats;
+
+// Start a new tail chunk, it is referenced by each connection plus once as the tail
+static netbuf * ICACHE_FLASH_ATTR
+chunkAppend(void)
 {
-  sint8 result = ESPCONN_OK;
-  if (conn->txbufferlen != 0) {
-    //os_printf("TX %p %d\n", conn, conn->txbufferlen);
-    conn->readytosend = false;
-    result = espconn_sent(conn->conn, (uint8_t*)conn->txbuffer, conn->txbufferlen);
-    conn->txbufferlen = 0;
-    if (result != ESPCONN_OK) {
-      os_printf("sendtxbuffer: espconn_sent error %d on conn %p\n", result, conn);
-      conn->txbufferlen = 0;
-      if (!conn->txoverflow_at) conn->txoverflow_at = system_get_time();
-    } else {
-      conn->sentbuffer = conn->txbuffer;
-      conn->txbuffer = NULL;
-      conn->txbufferlen = 0;
-    }
+  netbuf *c = netbuf_alloc();
+  if (c == NULL) return NULL;
+  c->refs = 1 + txclients;
+  if (txtail == NULL) {
+    txreleased = 0;
+  } else {
+    c->start = txtail->start + txtail->len;
+    txtail->next = c;
+    netbuf_release(txtail);
   }
-  return result;
+  txtail = c;
+  return c;
 }
 
-// espbuffsend adds data to the send buffer. If the previous send was completed it calls
-// sendtxbuffer and espconn_sent.
-// Returns ESPCONN_OK (0) for success, -128 if buffer is full or error from  espconn_sent
-// Use espbuffsend instead of espconn_sent as it solves the problem that espconn_sent must
-// only be called *after* receiving an espconn_sent_callback for the previous packet.
-static sint8 ICACHE_FLASH_ATTR
-espbuffsend(serbridgeConnData *conn, const char *data, uint16 len)
+// Send the next span of the chain to a connection, one espconn_sent at a time
+static void ICACHE_FLASH_ATTR
+sendNext(serbridgeConnData *conn)
 {
-  if (conn->txbufferlen >= MAX_TXBUFFER) goto overflow;
+  if (conn->conn == NULL || conn->txsending != 0) return;
+  netbuf *c = conn->txchunk;
+  // move past chunks that have been sent completely
+  while (conn->txoffset == c->len && c->next != NULL) {
+    conn->txchunk = c->next;
+    conn->txoffset = 0;
+    netbuf_release(c);
+    c = conn->txchunk;
+  }
+  int32_t avail = txreleased - (c->start + conn->txoffset);
+  if (avail <= 0) return;
+
+  uint16_t len = c->len - conn->txoffset;
+  if (len > avail) len = avail;
+  sint8 result = espconn_sent(conn->conn, (uint8_t*)c->data + conn->txoffset, len);
+  if (result == ESPCONN_OK) {
+    conn->txsending = len;
+    txcoalesce_sent(&txcoalesce, len);
+  } else {
+    // lwip is out of buffers, retried when more data arrives
+    os_printf("sendNext: espconn_sent error %d on conn %p\n", result, conn);
+    if (!conn->txoverflow_at) conn->txoverflow_at = system_get_time();
+  }
+}
 
-  // make sure we indeed have a buffer
-  if (conn->txbuffer == NULL) conn->txbuffer = os_zalloc(MAX_TXBUFFER);
-  if (conn->txbuffer == NULL) {
-    os_printf("espbuffsend: cannot alloc tx buffer\n");
-    return -128;
+// Policy for a connection that doesn't keep up: once it is SER_MAX_LAG behind it skips ahead to
+// the newest data, and if it hasn't completed a send in 10 seconds it is disconnected
+static void ICACHE_FLASH_ATTR
+checkLag(serbridgeConnData *conn)
+{
+  uint32_t lag = txtail->start + txtail->len - (conn->txchunk->start + conn->txoffset);
+  if (lag <= SER_MAX_LAG) return;
+
+  netbuf_overflow(&conn->txoverflow_at, conn->conn, "serbridge");
+  if (conn->txsending != 0) return; // the chunk being sent must stay, skip once it's done
+
+  while (conn->txchunk != txtail) {
+    netbuf *c = conn->txchunk;
+    conn->txchunk = c->next;
+    netbuf_release(c);
   }
+  conn->txoffset = txtail->len;
+  conn->txskipped += lag;
+}
 
-  // add to send buffer
-  uint16_t avail = conn->txbufferlen+len > MAX_TXBUFFER ? MAX_TXBUFFER-conn->txbufferlen : len;
-  os_memcpy(conn->txbuffer + conn->txbufferlen, data, avail);
-  conn->txbufferlen += avail;
+// True if the chain can take len more bytes, a PIPE frame (at most TLV_MAX_PACKET) needs at
+// most one chunk beyond the tail
+static bool ICACHE_FLASH_ATTR
+chunkRoom(uint16 len)
+{
+  if (txclients == 0 || txtail->len + len <= NETBUF_SIZE || netbuf_available()) return true;
+  // clients that are too far behind let go of their chunks, and eventually get disconnected
+  for (short i=0; i<MAX_CONN; i++)
+    if (connData[i].conn != NULL) checkLag(&connData[i]);
+  return netbuf_available();
+}
 
-  // try to send
-  sint8 result = ESPCONN_OK;
-  if (conn->readytosend) result = sendtxbuffer(conn);
+// Chunks went back to the pool, let the TLV link deliver the PIPE frames it held for us
+static void ICACHE_FLASH_ATTR
+chunkFreed(void)
+{
+  if (!txbusy) return;
+  txbusy = false;
+  tlv_channel_ready(TLV_PIPE);
+}
 
-  if (avail < len) {
-    // some data didn't fit into the buffer
-    if (conn->txbufferlen == 0) {
-      // we sent the prior buffer, so try again
-      return espbuffsend(conn, data+avail, len-avail);
+// Append data from the MCU to the chain and push it to every connection
+static void ICACHE_FLASH_ATTR
+serbridgeFanout(const char *data, uint16 len)
+{
+  if (txclients == 0) return;
+  while (len > 0) {
+    if (txtail->len == NETBUF_SIZE && chunkAppend() == NULL) {
+      os_printf("serbridge: cannot alloc tx chunk\n");
+      break;
     }
-    goto overflow;
+    uint16_t n = NETBUF_SIZE - txtail->len;
+    if (n > len) n = len;
+    os_memcpy(txtail->data + txtail->len, data, n);
+    txtail->len += n;
+    data += n;
+    len -= n;
   }
-  return result;
-
-overflow:
-  if (conn->txoverflow_at) {
-    // we've already been overflowing
-    if (system_get_time() - conn->txoverflow_at > 10*1000*1000) {
-      // no progress in 10 seconds, kill the connection
-      os_printf("serbridge: killing overlowing stuck conn %p\n", conn);
-      espconn_disconnect(conn->conn);
-    }
-    // else be silent, we already printed an error
-  } else {
-    // print 1-time message and take timestamp
-    os_printf("serbridge: txbuffer full, conn %p\n", conn);
-    conn->txoverflow_at = system_get_time();
+  uint32_t end = txtail->start + txtail->len;
+  if (!txcoalesce_ready(&txcoalesce, end - txreleased, NETBUF_SIZE)) return;
+  txreleased = end;
+  for (short i=0; i<MAX_CONN; i++) {
+    if (connData[i].conn == NULL) continue;
+    checkLag(&connData[i]);
+    sendNext(&connData[i]);
   }
-  return -128;
+}
+
+// Coalescing timer: held data is due
+static void ICACHE_FLASH_ATTR
+serbridgeFlush(void *arg)
+{
+  serbridgeFanout(NULL, 0);
+}
+
+// (Re)load the send coalescing policy from the config
+void ICACHE_FLASH_ATTR
+serbridgeTxConfig(void)
+{
+  txcoalesce_init(&txcoalesce, flashConfig.ser_tx_mode, flashConfig.ser_tx_delay_us,
+      flashConfig.ser_tx_bytes, &serbridgeTxStats, serbridgeFlush, NULL);
+  if (txtail != NULL) serbridgeFanout(NULL, 0); // release anything held under the old policy
 }
 
 //callback after the data are sent
@@ -183,13 +270,47 @@ serbridgeSentCb(void *arg)
 {
   serbridgeConnData *conn = ((struct espconn*)arg)->reverse;
   //os_printf("Sent CB %p\n", conn);
-  if (conn == NULL) return;
+  if (conn == NULL || conn->txchunk == NULL) return;
   //os_printf("%d ST\n", system_get_time());
-  if (conn->sentbuffer != NULL) os_free(conn->sentbuffer);
-  conn->sentbuffer = NULL;
-  conn->readytosend = true;
+  conn->txoffset += conn->txsending;
+  conn->txsending = 0;
   conn->txoverflow_at = 0;
-  sendtxbuffer(conn); // send possible new data in txbuffer
+  checkLag(conn);
+  sendNext(conn); // send possible new data
+  chunkFreed();
+}
+
+// Attach a new connection at the end of the chain, it only sees data that arrives from now on
+static bool ICACHE_FLASH_ATTR
+txAttach(serbridgeConnData *conn)
+{
+  if (txtail == NULL && chunkAppend() == NULL) return false;
+  conn->txchunk = txtail;
+  conn->txoffset = txtail->len;
+  txtail->refs++;
+  txclients++;
+  return true;
+}
+
+// Drop a connection's references to the rest of the chain
+static void ICACHE_FLASH_ATTR
+txDetach(serbridgeConnData *conn)
+{
+  netbuf *c = conn->txchunk;
+  if (c == NULL) return;
+  while (c != NULL) {
+    netbuf *next = c->next;
+    netbuf_release(c);
+    c = next;
+  }
+  conn->txchunk = NULL;
+  conn->txsending = 0;
+  if (--txclients == 0 && txtail->refs == 1) {
+    netbuf_release(txtail);
+    txtail = NULL;
+    txcoalesce_stop(&txcoalesce);
+  }
+  chunkFreed();
 }
 
 void ICACHE_FLASH_ATTR
@@ -199,11 +320,7 @@ console_process(char *buf, short len)
   for (short i=0; i<len; i++)
     console_write_char(buf[i]);
   // push the buffer into each open connection
-  for (short i=0; i<MAX_CONN; i++) {
-    if (connData[i].conn) {
-      espbuffsend(&connData[i], buf, len);
-    }
-  }
+  serbridgeFanout(buf, len);
 }
 
 //===== Connect / disconnect
@@ -216,15 +333,10 @@ serbridgeDisconCb(void *arg)
   if (conn == NULL) return;
 
   // Free buffers
-  if (conn->sentbuffer != NULL) os_free(conn->sentbuffer);
-  conn->sentbuffer = NULL;
-
-  if (conn->txbuffer != NULL) os_free(conn->txbuffer);
-  conn->txbuffer = NULL;
-  conn->txbufferlen = 0;
+  txDetach(conn);
 
   if (conn->rxbuffer != NULL && conn->rxbufferlen == 0) {
-    os_free(conn->rxbuffer);
+    heap_free(conn->rxbuffer);
     conn->rxbuffer = NULL;
   } else {
     DBG("Serial RX buffer still has data, leaving it\n");
@@ -242,14 +354,18 @@ serbridgeResetCb(void *arg, sint8 err)
   serbridgeDisconCb(arg);
 }
 
+CPUACCT_RECV(serbridgeRecvCb, "serbridge recv")
+CPUACCT_CB(serbridgeSentCb, "serbridge sent")
+
 // New connection callback, use one of the connection descriptors, if we have one left.
 static void ICACHE_FLASH_ATTR
 serbridgeConnectCb(void *arg)
 {
   struct espconn *conn = arg;
   // Find empty conndata in pool
+  // (a slot whose rx buffer is still draining to the MCU can't be reused yet)
   int i;
-  for (i=0; i<MAX_CONN; i++) if (connData[i].conn==NULL) break;
+  for (i=0; i<MAX_CONN; i++) if (connData[i].conn==NULL && connData[i].rxbuffer==NULL) break;
 #ifdef SERBR_DBG
   os_printf("Accept port %d, conn=%p, pool slot %d\n", conn->proto.tcp->local_port, conn, i);
 #endif
@@ -266,23 +382,18 @@ serbridgeConnectCb(void *arg)
   os_memset(connData+i, 0, sizeof(struct serbridgeConnData));
   connData[i].conn = conn;
   conn->reverse = connData+i;
-  connData[i].readytosend = true;
-
-  // allocate the rx buffer
-  connData[i].rxbuffer = os_zalloc(MAX_RXBUFFER);
-  connData[i].rxbufferlen = 0;
-  if (connData[i].rxbuffer == NULL) {
-    os_printf("Out of memory for RX buffer\n");
+  // the rx buffer is allocated when the client first sends something, so that connections
+  // that only watch the MCU's output cost next to nothing
+  if (!txAttach(connData+i)) {
+    os_printf("Out of memory for TX chunk\n");
     espconn_disconnect(conn);
     return;
-  } else {
-    DBG("SerConn: RX at %p\n", connData[i].rxbuffer);
   }
 
-  espconn_regist_recvcb(conn, serbridgeRecvCb);
+  espconn_regist_recvcb(conn, serbridgeRecvCb_acct);
   espconn_regist_disconcb(conn, serbridgeDisconCb);
   espconn_regist_reconcb(conn, serbridgeResetCb);
-  espconn_regist_sentcb(conn, serbridgeSentCb);
+  espconn_regist_sentcb(conn, serbridgeSentCb_acct);
 
   espconn_set_opt(conn, ESPCONN_REUSEADDR|ESPCONN_NODELAY);
 }
@@ -301,7 +412,9 @@ serTlvCb(tlv_data_t *tlv_data) {
             }
             if (connData[i].rxbuffer != NULL) {
               connData[i].rxbufferlen = 0;
-              os_free(connData[i].rxbuffer);
+              connData[i].rxtail = 0;
+              heap_free(connData[i].rxbuffer);
+              connData[i].rxbuffer = NULL;
             }
           }
           uint8_t data[] = { TLV_CONTROL_CONNECT, 0};
@@ -313,16 +426,16 @@ serTlvCb(tlv_data_t *tlv_data) {
       }
       break;
     case TLV_PIPE:
+      // all netbufs are waiting on slow clients, the frame is held until one comes back
+      if (!chunkRoom(tlv_data->length)) {
+        txbusy = true;
+        return TLV_BUSY;
+      }
       // log them to the console
       for (short i=0; i<tlv_data->length; i++)
         console_write_char(tlv_data->data[i]);
 
-      for (short i=0; i<MAX_CONN; i++) {
-        if (connData[i].conn != NULL) {
-          DBG("Connection %d gets them!\n", i);
-          espbuffsend(&connData[i], (char *) tlv_data->data, tlv_data->length);
-        }
-      }
+      serbridgeFanout((char *) tlv_data->data, tlv_data->length);
       break;
     case TLV_DEBUG:
       for (short i=0; i<tlv_data->length; i++)
@@ -354,9 +467,12 @@ serbridgeInit(int port)
   espconn_tcp_set_max_con_allow(&serbridgeConn1, MAX_CONN);
   espconn_regist_time(&serbridgeConn1, SER_BRIDGE_TIMEOUT, 0);
 
+  serbridgeTxConfig();
+
   tlv_register_channel_handler(TLV_PIPE, serTlvCb);
   tlv_register_channel_handler(TLV_DEBUG, serTlvCb);
   tlv_register_channel_handler(TLV_CONTROL, serTlvCb);
 
-  deferredTaskNum = register_usr_task(deferredTask);
+  deferredTaskNum = register_usr_task_prio(deferredTask, USR_TASK_PRIO_BULK, "serbridge");
+  tlv_register_wakeup(TLV_PIPE, deferredTaskNum);
 }
@@ -4,29 +4,44 @@
 #include <ip_addr.h>
 #include <c_types.h>
 #include <espconn.h>
+#include "txcoalesce.h"
+#include "netbuf.h"
 
-#define MAX_CONN 1
+#define MAX_CONN 4
 #define SER_BRIDGE_TIMEOUT 300 // 300 seconds = 5 minutes
 
-// Send buffer size
-#define MAX_TXBUFFER (2*1460)
-#define MAX_RXBUFFER (8*1460)
+// Buffer sizes: data to the clients is kept in pooled netbufs shared by all of them, a client
+// falling more than SER_MAX_LAG behind skips ahead
+#define SER_MAX_LAG (4*1460)
+// The rx buffer is a ring per client, kept small because MAX_CONN of them can be live at once
+// and they all come out of the heap. TCP receive is held once it fills past RX_HOLD_MARK, which
+// stops further receive callbacks and lets the TCP window close, so the room left only has to
+// take a couple of segments delivered together. It is resumed once it drains below
+// RX_UNHOLD_MARK.
+#define MAX_RXBUFFER (3*1460)
+#define RX_HOLD_MARK (MAX_RXBUFFER - 2*1460)
+#define RX_UNHOLD_MARK (MAX_RXBUFFER/4)
 
 typedef struct serbridgeConnData {
   uint16         rxbufferlen;   // length of data in rxbuffer
-  char           *rxbuffer;     // buffer for received data
+  uint16         rxtail;        // offset of the oldest data in rxbuffer
+  char           *rxbuffer;     // ring buffer for received data
+  bool           rxheld;        // TCP receive is on hold until rxbuffer drains
   struct espconn *conn;
   uint8_t        telnet_state;
-  uint16         txbufferlen;   // length of data in txbuffer
-  char           *txbuffer;     // buffer for the data to send
-  char           *sentbuffer;   // buffer sent, awaiting callback to get freed
-  uint32_t       txoverflow_at; // when the transmitter started to overflow
-  bool           readytosend;   // true, if txbuffer can be sent by espconn_sent
+  netbuf         *txchunk;      // chunk holding the next data to send
+  uint16         txoffset;      // offset of the next data to send in txchunk
+  uint16         txsending;     // bytes passed to espconn_sent, awaiting callback
+  uint32_t       txoverflow_at; // when the connection started to fall behind
+  uint32_t       txskipped;     // bytes skipped because the connection fell behind
 } serbridgeConnData;
 
 // port1 is transparent
 void ICACHE_FLASH_ATTR serbridgeInit(int port1);
 void ICACHE_FLASH_ATTR serbridgeUartCb(char *buf, short len);
 void ICACHE_FLASH_ATTR serbridgeReset();
+// reload the send coalescing policy after the config changed
+void ICACHE_FLASH_ATTR serbridgeTxConfig(void);
+extern txc_stats_t serbridgeTxStats;
 
 #endif /* __SER_BRIDGE_H__ */
@@ -37,6 +37,38 @@ static UartRecv_cb uart_recv_cb[4];
 
 static void uart0_rx_intr_handler(void *para);
 
+// UART0 transmit ring: writers append at tx_head, the txfifo-empty interrupt moves characters
+// from tx_tail into the hardware fifo. Writers only run with interrupts locked, with intr_lock
+// because they can be reached with interrupts already off (os_printf from an exception handler).
+#define TX_RING_SZ 1024         // must be a power of 2
+#define TX_FIFO_SZ 128
+#define TX_EMPTY_THRHD 32       // interrupt when the fifo drops below this many characters
+static char tx_ring[TX_RING_SZ];
+static volatile uint16_t tx_head, tx_tail;
+#define TX_RING_USED() ((uint16_t)(tx_head - tx_tail) & (TX_RING_SZ-1))
+#define TX_FIFO_USED() ((READ_PERI_REG(UART_STATUS(UART0))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)
+#define TX_NO_TASK 0xFF
+static volatile uint8_t tx_low_task = TX_NO_TASK; // posted once the tx side drains to tx_low_mark
+static volatile uint16_t tx_low_mark;
+
+// UART0 receive ring: the rx interrupt empties the fifo into the ring at rx_head and uart_recvTask
+// hands the callbacks contiguous spans straight out of the ring before advancing rx_tail. Each
+// index is only written by one side so no locking is needed. If the ring fills up the rx
+// interrupt is masked and the data stays in the fifo until the task has caught up.
+#define RX_RING_SZ 2048         // must be a power of 2
+static char rx_ring[RX_RING_SZ];
+static volatile uint16_t rx_head, rx_tail;
+static volatile bool rx_posted;  // recv task is posted and hasn't run yet
+static bool rx_in_task;          // recv task is calling the callbacks
+static uint32_t rx_overflows;    // times the hardware fifo overflowed
+static uint32_t rx_frame_errors; // framing errors seen
+#define RX_INT_ENA (UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA)
+
+// rx fifo interrupt thresholds, see uart0_rx_thresholds
+#define RX_FULL_DEFAULT 80
+#define RX_TOUT_DEFAULT 4
+static uint8_t rx_full_thrhd = RX_FULL_DEFAULT, rx_tout_thrhd = RX_TOUT_DEFAULT;
+
 /******************************************************************************
  * FunctionName : uart_config
  * Description  : Internal used function
@@ -76,19 +108,20 @@ uart_config(uint8 uart_no)
   if (uart_no == UART0) {
     // Configure RX interrupt conditions as follows: trigger rx-full when there are 80 characters
     // in the buffer, trigger rx-timeout when the fifo is non-empty and nothing further has been
-    // received for 4 character periods.
+    // received for 4 character periods (both can be changed with uart0_rx_thresholds).
     // Set the hardware flow-control to trigger when the FIFO holds 100 characters, although
     // we don't really expect the signals to actually be wired up to anything. It doesn't hurt
     // to set the threshold here...
     // We do not enable framing error interrupts 'cause they tend to cause an interrupt avalanche
     // and instead just poll for them when we get a std RX interrupt.
     WRITE_PERI_REG(UART_CONF1(uart_no),
-                   ((80 & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S) |
+                   ((rx_full_thrhd & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S) |
+                   ((TX_EMPTY_THRHD & UART_TXFIFO_EMPTY_THRHD) << UART_TXFIFO_EMPTY_THRHD_S) |
                    ((100 & UART_RX_FLOW_THRHD) << UART_RX_FLOW_THRHD_S) |
                    UART_RX_FLOW_EN |
-                   (4 & UART_RX_TOUT_THRHD) << UART_RX_TOUT_THRHD_S |
+                   (rx_tout_thrhd & UART_RX_TOUT_THRHD) << UART_RX_TOUT_THRHD_S |
                    UART_RX_TOUT_EN);
-    SET_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA);
+    SET_PERI_REG_MASK(UART_INT_ENA(uart_no), RX_INT_ENA);
   } else {
     WRITE_PERI_REG(UART_CONF1(uart_no),
                    ((UartDev.rcv_buff.TrigLvl & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S));
@@ -104,16 +137,104 @@ uart0_tx_fifo_length()
   return ((READ_PERI_REG(UART_STATUS(UART0))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT);
 }
 
+// Move as many characters as fit from the tx ring into the tx fifo, post the uart0_tx_notify
+// task once little enough is left and turn the txfifo-empty interrupt off once the ring is empty
+// and nobody waits for that. Called from the interrupt handler and, with interrupts locked, from
+// writers that find the ring full.
+static void // must not use ICACHE_FLASH_ATTR !
+uart0_tx_fill(void)
+{
+  uint8_t fifo = TX_FIFO_USED();
+  uint16_t tail = tx_tail;
+  while (fifo++ < TX_FIFO_SZ-1 && tail != tx_head) {
+    WRITE_PERI_REG(UART_FIFO(UART0), tx_ring[tail]);
+    tail = (tail+1) & (TX_RING_SZ-1);
+  }
+  tx_tail = tail;
+  if (tx_low_task != TX_NO_TASK && TX_RING_USED() + TX_FIFO_USED() <= tx_low_mark) {
+    uint8_t task = tx_low_task;
+    tx_low_task = TX_NO_TASK;
+    post_usr_task(task, 0);
+  }
+  if (tail == tx_head && tx_low_task == TX_NO_TASK)
+    CLEAR_PERI_REG_MASK(UART_INT_ENA(UART0), UART_TXFIFO_EMPTY_INT_ENA);
+}
+
+// Returns the number of characters that can be queued with uart0_tx_write without blocking
+uint16_t ICACHE_FLASH_ATTR
+uart0_tx_free(void)
+{
+  return TX_RING_SZ - 1 - TX_RING_USED();
+}
+
+// Returns the number of characters queued on UART0 that haven't gone out yet, ring and fifo
+uint16_t ICACHE_FLASH_ATTR
+uart0_tx_pending(void)
+{
+  return TX_RING_USED() + TX_FIFO_USED();
+}
+
+// Post task once at most mark characters are left to send. The check runs on the txfifo-empty
+// interrupt, which only fires below TX_EMPTY_THRHD once the ring is empty, so smaller marks are
+// raised to that. A later call replaces an earlier one.
+void ICACHE_FLASH_ATTR
+uart0_tx_notify(uint16_t mark, uint8_t task)
+{
+  uint32_t ps = intr_lock();
+  tx_low_mark = mark > TX_EMPTY_THRHD ? mark : TX_EMPTY_THRHD;
+  tx_low_task = task;
+  SET_PERI_REG_MASK(UART_INT_ENA(UART0), UART_TXFIFO_EMPTY_INT_ENA);
+  intr_unlock(ps);
+}
+
+// Queue up to len characters for transmission on UART0 without blocking,
+// returns the number of characters actually queued
+uint16_t ICACHE_FLASH_ATTR
+uart0_tx_write(const char *buf, uint16_t len)
+{
+  uint32_t ps = intr_lock();
+  uint16_t n = TX_RING_SZ - 1 - TX_RING_USED();
+  if (n > len) n = len;
+  for (uint16_t i=0; i<n; i++) {
+    tx_ring[tx_head] = buf[i];
+    tx_head = (tx_head+1) & (TX_RING_SZ-1);
+  }
+  if (n > 0)
+    SET_PERI_REG_MASK(UART_INT_ENA(UART0), UART_TXFIFO_EMPTY_INT_ENA);
+  intr_unlock(ps);
+  return n;
+}
+
+// Queue all of buf, if the ring is full feed the fifo by hand until everything fits. This
+// doesn't rely on the interrupt so it also works when called with interrupts disabled.
+static void ICACHE_FLASH_ATTR
+uart0_tx_blocking(const char *buf, uint16_t len)
+{
+  for (;;) {
+    uint16_t n = uart0_tx_write(buf, len);
+    buf += n;
+    len -= n;
+    if (len == 0) return;
+    uint32_t ps = intr_lock();
+    uart0_tx_fill();
+    intr_unlock(ps);
+  }
+}
+
 /******************************************************************************
  * FunctionName : uart1_tx_one_char
  * Description  : Internal used function
- *                Use uart1 interface to transfer one char
+ *                Use uart1 interface to transfer one char, UART0 goes through the tx ring
  * Parameters   : uint8 TxChar - character to tx
  * Returns      : OK
 *******************************************************************************/
 STATUS
 uart_tx_one_char(uint8 uart, uint8 c)
 {
+  if (uart == UART0) {
+    uart0_tx_blocking((char *)&c, 1);
+    return OK;
+  }
   //Wait until there is room in the FIFO
   while (((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)>=100) ;
   //Send the character
@@ -150,12 +271,7 @@ uart0_write_char(char c)
 void ICACHE_FLASH_ATTR
 uart0_tx_buffer(char *buf, uint16 len)
 {
-  uint16 i;
-
-  for (i = 0; i < len; i++)
-  {
-    uart_tx_one_char(UART0, buf[i]);
-  }
+  uart0_tx_blocking(buf, len);
 }
 
 /******************************************************************************
@@ -168,13 +284,29 @@ uart0_tx_buffer(char *buf, uint16 len)
 void ICACHE_FLASH_ATTR
 uart0_sendStr(const char *str)
 {
-  while(*str)
-  {
-    uart_tx_one_char(UART0, *str++);
-  }
+  uart0_tx_blocking(str, os_strlen(str));
 }
 
 static uint32 last_frm_err; // time in us when last framing error message was printed
+static volatile bool frm_err_report; // the recv task is to print a framing error message
+
+// Move the rx fifo into the rx ring, if the ring is full leave the rest in the fifo and mask
+// the rx interrupt until uart_recvTask has made room
+static void // must not use ICACHE_FLASH_ATTR !
+uart0_rx_fill(void)
+{
+  uint16_t head = rx_head;
+  while (READ_PERI_REG(UART_STATUS(UART0)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S)) {
+    uint16_t next = (head+1) & (RX_RING_SZ-1);
+    if (next == rx_tail) {
+      CLEAR_PERI_REG_MASK(UART_INT_ENA(UART0), RX_INT_ENA);
+      break;
+    }
+    rx_ring[head] = READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
+    head = next;
+  }
+  rx_head = head;
+}
 
 /******************************************************************************
  * FunctionName : uart0_rx_intr_handler
@@ -193,8 +325,10 @@ uart0_rx_intr_handler(void *para)
   // we end up largely ignoring framing errors and we just print a warning every second max
   if (READ_PERI_REG(UART_INT_RAW(uart_no)) & UART_FRM_ERR_INT_RAW) {
     uint32 now = system_get_time();
+    rx_frame_errors++;
     if (last_frm_err == 0 || (now - last_frm_err) > one_sec) {
-      os_printf("UART framing error (bad baud rate?)\n");
+      // printing goes through the tx ring in flash, leave it to the recv task
+      frm_err_report = true;
       last_frm_err = now;
     }
     // clear rx fifo (apparently this is not optional at this point)
@@ -202,52 +336,78 @@ uart0_rx_intr_handler(void *para)
     CLEAR_PERI_REG_MASK(UART_CONF0(uart_no), UART_RXFIFO_RST);
     // reset framing error
     WRITE_PERI_REG(UART_INT_CLR(UART0), UART_FRM_ERR_INT_CLR);
+    if (!rx_posted) {
+      rx_posted = true;
+      post_usr_task(uart_recvTaskNum, 0);
+    }
   // once framing errors are gone for 10 secs we forget about having seen them
   } else if (last_frm_err != 0 && (system_get_time() - last_frm_err) > 10*one_sec) {
     last_frm_err = 0;
   }
 
-  if (UART_RXFIFO_FULL_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_FULL_INT_ST)
-  ||  UART_RXFIFO_TOUT_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_TOUT_INT_ST))
-  {
+  if (READ_PERI_REG(UART_INT_RAW(uart_no)) & UART_RXFIFO_OVF_INT_RAW) {
+    rx_overflows++;
+    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_OVF_INT_CLR);
+  }
+
+  if (READ_PERI_REG(UART_INT_ST(uart_no)) & (UART_RXFIFO_FULL_INT_ST | UART_RXFIFO_TOUT_INT_ST)) {
     //DBG_UART("stat:%02X",*(uint8 *)UART_INT_ENA(uart_no));
-    ETS_UART_INTR_DISABLE();
-    post_usr_task(uart_recvTaskNum, 0);
+    uart0_rx_fill();
+    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR|UART_RXFIFO_TOUT_INT_CLR);
+    if (!rx_posted) {
+      rx_posted = true;
+      post_usr_task(uart_recvTaskNum, 0);
+    }
+  }
+
+  if (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_TXFIFO_EMPTY_INT_ST) {
+    uart0_tx_fill();
+    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_TXFIFO_EMPTY_INT_CLR);
   }
 }
 
 /******************************************************************************
  * FunctionName : uart_recvTask
- * Description  : system task triggered on receive interrupt, empties FIFO and calls callbacks
+ * Description  : system task triggered on receive interrupt, hands the rx ring to the callbacks
 *******************************************************************************/
 static void ICACHE_FLASH_ATTR
 uart_recvTask(os_event_t *events)
 {
-  while (READ_PERI_REG(UART_STATUS(UART0)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S)) {
-    //WRITE_PERI_REG(0X60000914, 0x73); //WTD // commented out by TvE
-
-    // read a buffer-full from the uart
-    uint16 length = 0;
-    char buf[128];
-    while ((READ_PERI_REG(UART_STATUS(UART0)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S)) &&
-           (length < 128)) {
-      buf[length++] = READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
-    }
+  rx_posted = false;
+  if (frm_err_report) {
+    frm_err_report = false;
+    os_printf("UART framing error (bad baud rate?)\n");
+  }
+  rx_in_task = true;
+  uint16_t head;
+  while ((head = rx_head) != rx_tail) {
+    // hand out the data up to the head or the end of the ring, whichever comes first
+    uint16_t tail = rx_tail;
+    uint16_t length = (head > tail ? head : RX_RING_SZ) - tail;
     // DBG_UART("RX CB %d\n", length);
 
     for (int i=0; i<MAX_CB; i++) {
-      if (uart_recv_cb[i] != NULL) (uart_recv_cb[i])(buf, length);
+      if (uart_recv_cb[i] != NULL) (uart_recv_cb[i])(rx_ring + tail, length);
     }
+    rx_tail = (tail + length) & (RX_RING_SZ-1);
   }
-  WRITE_PERI_REG(UART_INT_CLR(UART0), UART_RXFIFO_FULL_INT_CLR|UART_RXFIFO_TOUT_INT_CLR);
-  ETS_UART_INTR_ENABLE();
+  rx_in_task = false;
+  // the rx interrupt may have been masked because the ring was full
+  SET_PERI_REG_MASK(UART_INT_ENA(UART0), RX_INT_ENA);
 }
 
-// Turn UART interrupts off and poll for nchars or until timeout hits
+// Turn UART interrupts off and poll for nchars or until timeout hits. Characters already in
+// the rx ring come first, unless this is called from a receive callback which is in the middle
+// of processing the ring.
 uint16_t ICACHE_FLASH_ATTR
 uart0_rx_poll(char *buff, uint16_t nchars, uint32_t timeout_us) {
   ETS_UART_INTR_DISABLE();
   uint16_t got = 0;
+  while (!rx_in_task && got < nchars && rx_tail != rx_head) {
+    buff[got++] = rx_ring[rx_tail];
+    rx_tail = (rx_tail+1) & (RX_RING_SZ-1);
+  }
+  if (got == nchars) goto done;
   uint32_t start = system_get_time(); // time in us
   while (system_get_time()-start < timeout_us) {
     while (READ_PERI_REG(UART_STATUS(UART0)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S)) {
@@ -260,6 +420,43 @@ done:
   return got;
 }
 
+// Set the rx fifo interrupt thresholds: full is the number of characters in the fifo that
+// triggers an interrupt, tout the number of idle character periods after which a non-empty
+// fifo triggers one. Higher values mean fewer interrupts at high baud rates, lower values less
+// latency. Zero restores the default.
+void ICACHE_FLASH_ATTR
+uart0_rx_thresholds(uint8_t full, uint8_t tout) {
+  if (full > UART0_RX_FULL_MAX) full = UART0_RX_FULL_MAX;
+  if (tout > UART0_RX_TOUT_MAX) tout = UART0_RX_TOUT_MAX;
+  rx_full_thrhd = full > 0 ? full : RX_FULL_DEFAULT;
+  rx_tout_thrhd = tout > 0 ? tout : RX_TOUT_DEFAULT;
+  uint32_t conf = READ_PERI_REG(UART_CONF1(UART0));
+  conf &= ~((UART_RXFIFO_FULL_THRHD << UART_RXFIFO_FULL_THRHD_S) |
+            (UART_RX_TOUT_THRHD << UART_RX_TOUT_THRHD_S));
+  conf |= ((rx_full_thrhd & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S) |
+          ((rx_tout_thrhd & UART_RX_TOUT_THRHD) << UART_RX_TOUT_THRHD_S);
+  WRITE_PERI_REG(UART_CONF1(UART0), conf);
+  DBG_UART("UART rx thresholds full=%d tout=%d\n", rx_full_thrhd, rx_tout_thrhd);
+}
+
+// Returns the number of times the hardware rx fifo overflowed
+uint32_t ICACHE_FLASH_ATTR
+uart0_rx_overflows(void) {
+  return rx_overflows;
+}
+
+// Returns the number of framing errors seen, typically due to a baud rate mismatch
+uint32_t ICACHE_FLASH_ATTR
+uart0_rx_frame_errors(void) {
+  return rx_frame_errors;
+}
+
+// Returns true once everything queued for UART0 has left the tx fifo
+bool ICACHE_FLASH_ATTR
+uart0_tx_idle(void) {
+  return tx_head == tx_tail && uart0_tx_fifo_length() == 0;
+}
+
 void ICACHE_FLASH_ATTR
 uart0_baud(int rate) {
   os_printf("UART %d baud\n", rate);
@@ -288,7 +485,7 @@ uart_init(UartBautRate uart0_br, UartBautRate uart1_br)
   // install uart1 putc callback
   os_install_putc1((void *)uart0_write_char);
 
-  uart_recvTaskNum = register_usr_task(uart_recvTask);
+  uart_recvTaskNum = register_usr_task_prio(uart_recvTask, USR_TASK_PRIO_UART, "uart rx");
 }
 
 void ICACHE_FLASH_ATTR
@@ -14,9 +14,22 @@ void uart_init(UartBautRate uart0_br, UartBautRate uart1_br);
 uint8_t ICACHE_FLASH_ATTR
 uart0_tx_fifo_length(void);
 
-// Transmit a buffer of characters on UART0
+// Transmit a buffer of characters on UART0. The characters are queued in a ring that is
+// drained by the tx interrupt, this only blocks if the ring is full.
 void uart0_tx_buffer(char *buf, uint16 len);
 
+// Returns the space left in the UART0 tx ring
+uint16_t uart0_tx_free(void);
+
+// Queue up to len characters on UART0 without blocking, returns the number queued
+uint16_t uart0_tx_write(const char *buf, uint16_t len);
+
+// Returns the number of characters queued on UART0 and not sent yet, ring and fifo
+uint16_t uart0_tx_pending(void);
+
+// Post the user task once at most mark characters are left to send on UART0, one shot
+void uart0_tx_notify(uint16_t mark, uint8_t task);
+
 void uart0_write_char(char c);
 STATUS uart_tx_one_char(uint8 uart, uint8 c);
 
@@ -24,7 +37,8 @@ void uart1_write_char(char c);
 
 // Add a receive callback function, this is called on the uart receive task each time a chunk
 // of bytes are received. A small number of callbacks can be added and they are all called
-// with all new characters.
+// with all new characters. The buffer points into the receive ring, callbacks must not
+// modify it or hold on to it after returning.
 void uart_add_recv_cb(UartRecv_cb cb);
 
 // Turn UART interrupts off and poll for nchars or until timeout hits
@@ -32,4 +46,19 @@ uint16_t uart0_rx_poll(char *buff, uint16_t nchars, uint32_t timeout_us);
 
 void uart0_baud(int rate);
 
+// Set the rx fifo full and idle timeout interrupt thresholds, zero restores the default and
+// larger values than the maximums are clamped
+#define UART0_RX_FULL_MAX 100  // stay at or below the hw flow control threshold
+#define UART0_RX_TOUT_MAX 127  // width of the hw field
+void uart0_rx_thresholds(uint8_t full, uint8_t tout);
+
+// Returns the number of times the hardware rx fifo overflowed
+uint32_t uart0_rx_overflows(void);
+
+// Returns the number of framing errors seen, typically due to a baud rate mismatch
+uint32_t uart0_rx_frame_errors(void);
+
+// Returns true once everything queued for UART0 has left the tx fifo
+bool uart0_tx_idle(void);
+
 #endif /* __UART_H__ */
@@ -13,8 +13,8 @@
 #include "syslog.h"
 #include "time.h"
 #include "task.h"
+#include "mempool.h"
 
-extern void * mem_trim(void *m, size_t s);	// not well documented...
 
 #ifdef SYSLOG_DBG
 #define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
@@ -184,7 +184,7 @@ static void ICACHE_FLASH_ATTR syslog_udp_sent_cb(void *arg)
   // datagram is delivered - free and advance queue
   syslog_entry_t *pse = syslogQueue;
   syslogQueue = syslogQueue -> next;
-  os_free(pse);
+  mempool_free(pse);
 
   if (syslogQueue == NULL)
     syslog_set_status(SYSLOG_READY);
@@ -282,7 +282,7 @@ void ICACHE_FLASH_ATTR syslog_init(char *syslog_host)
     syslog_entry_t *pse = syslogQueue;
     while (pse != NULL) {
       syslog_entry_t *next = pse->next;
-      os_free(pse);
+      mempool_free(pse);
       pse = next;
     }
     syslogQueue = NULL;
@@ -315,7 +315,7 @@ void ICACHE_FLASH_ATTR syslog_init(char *syslog_host)
   espconn_regist_recvcb(syslog_espconn, syslog_udp_recv_cb);			// register a udp packet receiving callback
 #endif
   espconn_regist_sentcb(syslog_espconn, syslog_udp_sent_cb);			// register a udp packet sent callback
-  syslog_task = register_usr_task(syslog_udp_send_event);
+  syslog_task = register_usr_task_prio(syslog_udp_send_event, USR_TASK_PRIO_BULK, "syslog");
   syslogHost.min_heap_size = flashConfig.syslog_minheap;
 
 // the wifi_set_broadcast_if must be handled global in connection handler...
@@ -379,7 +379,7 @@ LOCAL syslog_entry_t ICACHE_FLASH_ATTR *
 syslog_compose(uint8_t facility, uint8_t severity, const char *tag, const char *fmt, ...)
 {
   DBG("[%dµs] %s id=%lu\n", WDEV_NOW(), __FUNCTION__, syslog_msgid);
-  syslog_entry_t *se = os_zalloc(sizeof (syslog_entry_t) + 1024);	// allow up to 1k datagram
+  syslog_entry_t *se = mempool_zalloc(sizeof (syslog_entry_t) + 1024);	// allow up to 1k datagram
   char *p = se->datagram;
   se->tick = WDEV_NOW();			// 0 ... 4294.967295s
   se->msgid = syslog_msgid;
@@ -423,7 +423,7 @@ syslog_compose(uint8_t facility, uint8_t severity, const char *tag, const char *
   va_end(arglist);
 
   se->datagram_len = p - se->datagram;
-  se = mem_trim(se, sizeof(syslog_entry_t) + se->datagram_len + 1);
+  se = mempool_trim(se, sizeof(syslog_entry_t) + se->datagram_len + 1);
   return se;
 }
 
@@ -0,0 +1,16 @@
+// Just enough of the SDK for building the SDK independent modules on the host
+#ifndef _ESP8266_H_
+#define _ESP8266_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ICACHE_FLASH_ATTR
+#define os_memcpy memcpy
+#define os_memmove memmove
+#define os_memset memset
+#define os_printf printf
+
+#endif
@@ -0,0 +1,266 @@
+// Host test of the CRC framed TLV receiver (tlv/tlvframe.c): clean, bit-flipped, truncated and
+// garbage-prefixed streams must deliver every intact frame, in order, and none of the damaged
+// ones. A stress run then drops and flips random bytes of long streams at several rates and
+// measures how long the receiver takes to recover:
+//   tlv_frame_test [rate...]     per byte corruption rates, default 1e-4 1e-3 1e-2
+
+#include <esp8266.h>
+#include <stdlib.h>
+#include "crc16.h"
+#include "tlvframe.h"
+
+#define NFRAMES 12
+#define STREAM_MAX 4096
+
+static tlv_data_t sent[NFRAMES];
+static tlv_data_t got[4*NFRAMES];
+static int ngot;
+static int failures;
+
+// stress run state: the delivery callback matches frames against the stream as they arrive
+#define STRESS_FRAMES 20000
+static bool stressing;
+static void stress_deliver(tlv_data_t *tlv);
+
+void tlv_frame_deliver(tlv_data_t *tlv) {
+  if (stressing) {
+    stress_deliver(tlv);
+    return;
+  }
+  if (ngot < 4*NFRAMES) got[ngot] = *tlv;
+  ngot++;
+}
+
+// [SOF, channel, length, data..., crc lo, crc hi]
+static int encode(uint8_t *out, const tlv_data_t *f) {
+  out[0] = TLV_SOF;
+  out[1] = f->channel;
+  out[2] = f->length;
+  memcpy(out+3, f->data, f->length);
+  uint16_t crc = crc16_data(out+1, f->length+2, 0);
+  out[3+f->length] = crc & 0xFF;
+  out[4+f->length] = crc >> 8;
+  return f->length + 5;
+}
+
+static void make_frames(unsigned seed) {
+  srand(seed);
+  for (int i=0; i<NFRAMES; i++) {
+    sent[i].channel = rand() % 4;
+    sent[i].length = rand() % (TLV_MAX_PACKET+1);
+    for (int j=0; j<sent[i].length; j++) sent[i].data[j] = rand();
+    if (i % 3 == 0 && sent[i].length > 4) sent[i].data[2] = TLV_SOF; // false starts of frame
+  }
+}
+
+static bool same(const tlv_data_t *a, const tlv_data_t *b) {
+  return a->channel == b->channel && a->length == b->length &&
+      memcmp(a->data, b->data, a->length) == 0;
+}
+
+// feed the stream in pieces of chunk bytes, check that exactly the frames other than skip
+// (-1 for none) arrived in order
+static void check(const char *what, const uint8_t *stream, int len, int chunk, int skip) {
+  tlv_framed = true;
+  tlv_frame_reset();
+  ngot = 0;
+  for (int pos=0; pos<len; pos+=chunk) {
+    int n = len-pos < chunk ? len-pos : chunk;
+    if (tlv_frame_rx(stream+pos, n) != n) {
+      printf("FAIL %s: fell back to unframed\n", what);
+      failures++;
+      return;
+    }
+  }
+  int want = 0;
+  for (int i=0; i<NFRAMES; i++) {
+    if (i == skip) continue;
+    if (want >= ngot || !same(&got[want], &sent[i])) {
+      printf("FAIL %s: frame %d missing or out of order\n", what, i);
+      failures++;
+      return;
+    }
+    want++;
+  }
+  if (ngot != want) {
+    printf("FAIL %s: %d frames delivered, expected %d\n", what, ngot, want);
+    failures++;
+  }
+}
+
+// the stream of all frames, with offsets of where each one starts
+static int build(uint8_t *stream, int *start) {
+  int len = 0;
+  for (int i=0; i<NFRAMES; i++) {
+    start[i] = len;
+    len += encode(stream+len, &sent[i]);
+  }
+  start[NFRAMES] = len;
+  return len;
+}
+
+// Stress run: STRESS_FRAMES frames, each carrying its sequence number, with every byte dropped
+// or one of its bits flipped with probability rate (half each). Every frame that wasn't touched
+// must still arrive, in order: the receiver is back in sync by the first intact frame after any
+// corruption. Recovery is measured from the first damaged byte of a frame to the next good
+// delivery, in bytes of input and in frames.
+static tlv_data_t *st_sent;
+static int st_next;               // sequence number the next delivery may start looking at
+static int *st_delivered_at;      // input offset at which each frame arrived, -1 if it didn't
+static long st_fed;               // bytes fed so far
+static int st_bogus;              // deliveries that match no frame (CRC16 collisions)
+
+static void stress_deliver(tlv_data_t *tlv) {
+  int seq = tlv->length >= 2 ? tlv->data[0] | tlv->data[1] << 8 : -1;
+  if (seq < st_next || seq >= STRESS_FRAMES || !same(tlv, &st_sent[seq])) {
+    st_bogus++;
+    return;
+  }
+  st_delivered_at[seq] = st_fed;
+  st_next = seq + 1;
+}
+
+static void stress(double rate, unsigned seed) {
+  static tlv_data_t frames[STRESS_FRAMES];
+  static uint8_t damaged[STRESS_FRAMES];
+  static int delivered_at[STRESS_FRAMES];
+  static long corrupt_at[STRESS_FRAMES];  // input offset of a frame's first damaged byte
+  static uint8_t in[STRESS_FRAMES * (TLV_MAX_PACKET+5)];
+  uint8_t enc[TLV_MAX_PACKET+5];
+
+  srand(seed);
+  long len = 0;
+  for (int i=0; i<STRESS_FRAMES; i++) {
+    tlv_data_t *f = &frames[i];
+    f->channel = rand() % 4;
+    f->length = 2 + rand() % (TLV_MAX_PACKET-1);
+    f->data[0] = i & 0xFF;
+    f->data[1] = i >> 8;
+    for (int j=2; j<f->length; j++) f->data[j] = rand();
+    damaged[i] = 0;
+    int n = encode(enc, f);
+    for (int j=0; j<n; j++) {
+      double r = rand() / (RAND_MAX + 1.0);
+      if (r < rate && !damaged[i]) {
+        damaged[i] = 1;
+        corrupt_at[i] = len;
+      }
+      if (r < rate/2) continue;                            // dropped
+      in[len++] = r < rate ? enc[j] ^ 1 << rand() % 8 : enc[j];  // flipped or intact
+    }
+  }
+
+  st_sent = frames;
+  st_delivered_at = delivered_at;
+  for (int i=0; i<STRESS_FRAMES; i++) delivered_at[i] = -1;
+  st_next = 0;
+  st_bogus = 0;
+  stressing = true;
+  tlv_framed = true;
+  tlv_frame_reset();
+  int fallbacks = 0;
+  for (st_fed=1; st_fed<=len; st_fed++) {
+    if (tlv_frame_rx(in+st_fed-1, 1) == 0) {  // fell back to unframed, count it and go on
+      fallbacks++;
+      tlv_framed = true;
+      tlv_frame_reset();
+    }
+  }
+  stressing = false;
+
+  int ndamaged = 0, lost = 0, intact_lost = 0, max_frames = 0, events = 0;
+  long total_bytes = 0, max_bytes = 0;
+  for (int i=0; i<STRESS_FRAMES; i++) {
+    ndamaged += damaged[i];
+    if (delivered_at[i] < 0) {
+      lost++;
+      if (!damaged[i]) intact_lost++;
+    }
+    // recovery: from the first damaged byte of a frame that follows a good one, to the next
+    // frame that arrives
+    if (!damaged[i] || (i > 0 && damaged[i-1])) continue;
+    int j = i+1;
+    while (j < STRESS_FRAMES && delivered_at[j] < 0) j++;
+    if (j == STRESS_FRAMES) continue;
+    long bytes = delivered_at[j] - corrupt_at[i];
+    events++;
+    total_bytes += bytes;
+    if (bytes > max_bytes) max_bytes = bytes;
+    if (j - i > max_frames) max_frames = j - i;
+  }
+
+  printf("  rate %g: %d/%d frames damaged, %d lost, %d intact lost, %d bogus, %d fallbacks; "
+      "recovery avg %ld max %ld bytes, max %d frames\n", rate, ndamaged, STRESS_FRAMES, lost,
+      intact_lost, st_bogus, fallbacks, events ? total_bytes / events : 0, max_bytes, max_frames);
+  if (intact_lost != 0 || st_bogus != 0 || fallbacks != 0) {
+    printf("FAIL stress at rate %g: the receiver didn't resync within one frame\n", rate);
+    failures++;
+  }
+}
+
+int main(int argc, char **argv) {
+  static uint8_t stream[STREAM_MAX], damaged[STREAM_MAX];
+  int start[NFRAMES+1];
+  char what[80];
+
+  for (unsigned seed=1; seed<=20; seed++) {
+    make_frames(seed);
+    int len = build(stream, start);
+
+    check("clean", stream, len, len, -1);
+    check("clean, byte at a time", stream, len, 1, -1);
+
+    // every single bit flip in one frame loses that frame and only that one
+    int k = seed % NFRAMES;
+    for (int pos=start[k]; pos<start[k+1]; pos++) {
+      for (int bit=0; bit<8; bit++) {
+        memcpy(damaged, stream, len);
+        damaged[pos] ^= 1 << bit;
+        snprintf(what, sizeof(what), "seed %d, frame %d, bit %d of byte %d flipped", seed, k,
+            bit, pos - start[k]);
+        check(what, damaged, len, 7, k);
+      }
+    }
+
+    // a frame cut short anywhere loses that frame and only that one
+    for (int cut=1; cut<start[k+1]-start[k]; cut++) {
+      int n = start[k] + cut;
+      memcpy(damaged, stream, n);
+      memcpy(damaged+n, stream+start[k+1], len-start[k+1]);
+      snprintf(what, sizeof(what), "seed %d, frame %d truncated to %d bytes", seed, k, cut);
+      check(what, damaged, n + len-start[k+1], 13, k);
+    }
+
+    // garbage in front of the first frame costs nothing, even with a few starts of frame in
+    // it (fewer than TLV_CRC_FALLBACK, or the receiver rightly gives up on framing)
+    for (int g=1; g<=2*TLV_MAX_PACKET; g+=9) {
+      for (int i=0; i<g; i++) damaged[i] = i % 32 == 0 ? TLV_SOF : rand();
+      memcpy(damaged+g, stream, len);
+      snprintf(what, sizeof(what), "seed %d, %d bytes of garbage first", seed, g);
+      check(what, damaged, g+len, 16, -1);
+    }
+  }
+
+  // nothing but garbage makes the receiver give up on framing
+  for (int i=0; i<STREAM_MAX; i++) damaged[i] = i % 3 == 0 ? TLV_SOF : 0x40;
+  tlv_framed = true;
+  tlv_frame_reset();
+  ngot = 0;
+  if (tlv_frame_rx(damaged, STREAM_MAX) == STREAM_MAX || tlv_framed || ngot != 0) {
+    printf("FAIL garbage: receiver didn't fall back to unframed\n");
+    failures++;
+  }
+
+  static const double rates[] = { 1e-4, 1e-3, 1e-2 };
+  printf("tlv_frame_test: stress, %d frames per run\n", STRESS_FRAMES);
+  if (argc > 1) {
+    for (int i=1; i<argc; i++) stress(atof(argv[i]), i);
+  } else {
+    for (int i=0; i<(int)(sizeof(rates)/sizeof(rates[0])); i++) stress(rates[i], i+1);
+  }
+
+  printf("tlv_frame_test: %s, %ld crc errors, %ld length errors, %ld resyncs\n",
+      failures ? "FAILED" : "ok", (long) tlv_frame_errors.crc_errors,
+      (long) tlv_frame_errors.length_errors, (long) tlv_frame_errors.resyncs);
+  return failures != 0;
+}
@@ -0,0 +1,102 @@
+// Host benchmark of the VNC RX buffer handling in vnc/vncbridge.c. vnc_proto_handler used to
+// shift the rest of rxbuffer down after every RFB message, it now advances a read cursor
+// (rxbufferpos) and vncbridgeRecvCb only compacts when a segment doesn't fit at the end. Both
+// are modelled here on bursts of 6 byte PointerEvents, handling a message is reduced to a
+// checksum so only the buffer handling is measured.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_RXBUFFER (6*1460)   // as in vncbridge.c
+#define SEGMENT 1460            // one TCP segment
+#define MSG 6                   // PointerEvent
+
+typedef struct {
+  uint8_t buf[MAX_RXBUFFER];
+  uint16_t len, pos;
+  uint64_t moved;               // bytes shifted around
+  uint32_t sum;
+} rx_t;
+
+static void handle(rx_t *rx, const uint8_t *m) {
+  rx->sum = rx->sum * 31 + (m[1] ^ (m[2] << 8 | m[3]) ^ (m[4] << 8 | m[5]));
+}
+
+// the old way: parse at the front, shift the rest down after each message
+static void recv_memmove(rx_t *rx, const uint8_t *data, uint16_t len) {
+  memcpy(rx->buf + rx->len, data, len);
+  rx->len += len;
+  while (rx->len >= MSG) {
+    handle(rx, rx->buf);
+    memmove(rx->buf, rx->buf + MSG, rx->len - MSG);
+    rx->moved += rx->len - MSG;
+    rx->len -= MSG;
+  }
+}
+
+// the cursor: parse in place, compact only if the segment doesn't fit, rewind once empty
+static void recv_cursor(rx_t *rx, const uint8_t *data, uint16_t len) {
+  if (rx->len + len > MAX_RXBUFFER) {
+    rx->len -= rx->pos;
+    memmove(rx->buf, rx->buf + rx->pos, rx->len);
+    rx->moved += rx->len;
+    rx->pos = 0;
+  }
+  memcpy(rx->buf + rx->len, data, len);
+  rx->len += len;
+  while (rx->len - rx->pos >= MSG) {
+    handle(rx, rx->buf + rx->pos);
+    rx->pos += MSG;
+  }
+  if (rx->pos == rx->len) rx->len = rx->pos = 0;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef void (*recv_fn)(rx_t *, const uint8_t *, uint16_t);
+
+// feed iter bursts of burst bytes in chunks of chunk bytes, report ns per message
+static uint32_t run(const char *name, recv_fn fn, const uint8_t *stream, uint16_t burst,
+    uint16_t chunk, int iter) {
+  static rx_t rx;
+  memset(&rx, 0, sizeof(rx));
+  double t = now_ns();
+  for (int i=0; i<iter; i++)
+    for (uint16_t off=0; off<burst; off+=chunk)
+      fn(&rx, stream + off, burst-off < chunk ? burst-off : chunk);
+  t = now_ns() - t;
+  uint32_t msgs = (uint32_t) iter * (burst / MSG);
+  printf("  %-8s %8.1f ns/msg %10.0f bytes moved/burst\n", name, t / msgs,
+      (double) rx.moved / iter);
+  return rx.sum;
+}
+
+int main(void) {
+  static uint8_t stream[MAX_RXBUFFER];
+  for (int i=0; i<MAX_RXBUFFER; i++)
+    stream[i] = i % MSG == 0 ? 5 /* PointerEvent */ : (uint8_t) (i * 7 + 3);
+
+  struct { const char *what; uint16_t burst, chunk; int iter; } cases[] = {
+    { "full buffer parsed at once (link was paused)", MAX_RXBUFFER - MAX_RXBUFFER % MSG,
+      MAX_RXBUFFER - MAX_RXBUFFER % MSG, 200 },
+    { "one segment at a time", MAX_RXBUFFER - MAX_RXBUFFER % MSG, SEGMENT, 2000 },
+    { "small writes, messages split across them", MAX_RXBUFFER - MAX_RXBUFFER % MSG, 100, 2000 },
+  };
+  int fail = 0;
+  for (unsigned c=0; c<sizeof(cases)/sizeof(cases[0]); c++) {
+    printf("%s, %d byte burst in %d byte pieces:\n", cases[c].what, cases[c].burst, cases[c].chunk);
+    uint32_t a = run("memmove", recv_memmove, stream, cases[c].burst, cases[c].chunk, cases[c].iter);
+    uint32_t b = run("cursor", recv_cursor, stream, cases[c].burst, cases[c].chunk, cases[c].iter);
+    if (a != b) {
+      printf("  parsed messages differ!\n");
+      fail = 1;
+    }
+  }
+  return fail;
+}
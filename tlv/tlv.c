@@ -1,11 +1,16 @@
 #include "tlv.h"
 #include "config.h"
+#include "crc16.h"
 #ifdef SYSLOG
 #include "syslog.h"
 #else
 #define syslog(a, ...) do {} while (0);
 #endif
 #include <uart.h>
+#include "task.h"
+#include "tlvtap.h"
+#include "tlvframe.h"
+#include "heapstat.h"
 
 #define TLV_DBG
 #ifdef TLV_DBG
@@ -17,8 +22,62 @@
 #endif
 
 volatile static bool tlv_send_flow_paused = false;
+static bool tlv_flow_held;         // the MCU explicitly paused us with [TLV_CONTROL_FLOW, 1]
+static uint32_t tlv_paused_since;  // system_get_time() when the send window closed, 0 if open
+static uint32_t tlv_paused_rem_us; // closed time not yet added to tlv_link_stats.paused_ms
+uint32_t tlv_stalls;               // lost resume messages recovered by the stall detector
 
-void tlv_poll_uart(void);
+// credit based flow control, see tlv.h
+static bool tlv_credit_mode = false;
+static uint8_t tlv_credits = 0;
+static uint8_t tlv_peer_caps = 0;
+
+// Channel registry: any of the 256 channels can get a slot holding its receive handler, its
+// send window wakeup and the frames its handler was too busy to take. tlv_slot maps a channel
+// to its slot so dispatch is a table lookup.
+#define TLV_NO_TASK 0xFF
+#define TLV_HOLD_FRAMES 2  // frames held for a busy handler, the MCU may have some in flight
+#define TLV_HOLD_RETRY_MS 100 // held frames are offered again this often, a ready call may not come
+typedef struct {
+  uint8_t channel;
+  tlv_receive_cb cb;
+  tlv_large_cb large_cb;   // gets reassembled payloads whole, else they go to cb in pieces
+  uint8_t wake_task;       // task posted when the send window opens, see tlv_register_wakeup
+  bool blocked;            // a tlv_send was refused
+  bool paused;             // the MCU has been told to stop sending on this channel
+  uint8_t nheld;
+  tlv_data_t *held;        // allocated the first time the handler is busy
+  tlv_chan_stats_t stats;
+} tlv_channel_t;
+static uint8_t tlv_slot[256];      // channel -> slot+1, 0 if none
+static tlv_channel_t tlv_chan[TLV_MAX_CHANNELS];
+static uint8_t tlv_nchan;
+uint32_t tlv_busy_drops;           // frames dropped because a busy handler's hold was full
+static ETSTimer tlv_hold_timer;
+static bool tlv_hold_armed;
+
+// statistics, see tlv.h
+tlv_link_stats_t tlv_link_stats;
+const uint16_t tlv_resume_bucket_ms[TLV_RESUME_BUCKETS-1] = { 1, 2, 5, 10, 20, 50, 100 };
+static tlv_chan_stats_t tlv_other_stats; // channels without a slot
+
+static ETSTimer tlv_wake_timer;    // fallback for windows that open without a message
+static bool tlv_wake_armed;
+uint32_t tlv_wakeups_avoided;
+
+// baud rate negotiation, see tlv.h
+static enum {
+  BAUD_IDLE, BAUD_PROPOSED, BAUD_SWITCH, BAUD_TEST, BAUD_DONE
+} tlv_baud_state = BAUD_IDLE;
+static uint8_t tlv_baud_then;      // state after BAUD_SWITCH
+static const uint32_t tlv_baud_rates[] = { 2000000, 921600, 460800 }; // tried in this order
+static uint8_t tlv_baud_try;       // index into tlv_baud_rates
+static uint32_t tlv_baud_cur;      // current link rate, 0 until negotiated
+static uint32_t tlv_baud_target;   // rate being switched to
+static uint32_t tlv_baud_errs;     // error count at the last check
+static ETSTimer tlv_baud_timer;
+static const uint8_t tlv_baud_pattern[] = { 0x55, 0xAA, 0x00, 0xFF, 0x0F, 0xF0, 0x33, 0xCC,
+                                            0x01, 0x80, 0xFE, 0x7F, 0xA5, 0x5A, 0x96, 0x69 };
 
 static uint32_t lastUart = 0;
 
@@ -26,7 +85,30 @@ bool ICACHE_FLASH_ATTR
 tlv_is_send_paused() {
   int gpio0 = GPIO_INPUT_GET(0);
   if (gpio0 != 0) DBG("gpio0 is %d\n", gpio0);
-  return tlv_send_flow_paused;
+  return tlv_credit_mode ? tlv_credits == 0 : tlv_send_flow_paused;
+}
+
+// put a frame on the uart, with start of frame and CRC if framing is on
+static void ICACHE_FLASH_ATTR tlv_write_frame(uint8_t channel, char *buf, uint8_t len) {
+  tlv_tap_frame(TLV_TAP_TX, channel, buf, len);
+  if (tlv_framed) {
+    uint8_t hdr[] = { TLV_SOF, channel, len };
+    uint16_t crc = crc16_data(hdr+1, 2, 0);
+    crc = crc16_data((uint8_t *) buf, len, crc);
+    uart0_tx_buffer((char *) hdr, sizeof(hdr));
+    uart0_tx_buffer(buf, len);
+    uart0_write_char((char) (crc & 0xFF));
+    uart0_write_char((char) (crc >> 8));
+  } else {
+    uart0_write_char((char) channel);
+    uart0_write_char((char) len);
+    uart0_tx_buffer(buf, len);
+  }
+}
+
+// send a control message to the MCU right away, control replies are not subject to flow control
+static void ICACHE_FLASH_ATTR tlv_send_control(uint8_t *buf, uint8_t len) {
+  tlv_write_frame(TLV_CONTROL, (char *) buf, len);
 }
 
 void ICACHE_FLASH_ATTR tlv_send_fc(bool enabled) {
@@ -36,24 +118,561 @@ void ICACHE_FLASH_ATTR tlv_send_fc(bool enabled) {
   uart0_tx_buffer(buf, 4);
 }
 
+// Transmit queues: tlv_send queues a frame on its channel's queue and tlv_pump moves frames to
+// the uart while the MCU's send window is open. CONTROL and HID are served strictly first, the
+// bulk queues (PIPE, and DEBUG which also takes any higher channel) share what is left by deficit
+// round robin weighted by TLV_TXQ_WEIGHTS. A bulk frame is only handed to the uart while less
+// than TLV_FRAME_COST bytes are still waiting there, so a keystroke queued behind a telnet session
+// pushing data waits for at most two bulk frames on the wire (one draining, one just written),
+// not for a full tx ring. The uart posts tlv_tx_task when it has drained to refill it.
+#define TLV_FRAME_COST (TLV_MAX_PACKET+5)   // largest frame on the wire, incl. CRC framing
+#define TLV_TXQ_SIZES { 2, 2, 4, 2 }        // frames queued per channel
+#define TLV_TXQ_WEIGHTS { 0, 0, 3, 1 }      // bulk share, 0 for the strict priority queues
+#define TLV_TXQ_FIRST_BULK TLV_PIPE
+#define TLV_TXQ_ENTRIES 10                  // sum of TLV_TXQ_SIZES
+
+typedef struct {
+  uint8_t channel, len;
+  uint32_t queued;                          // system_get_time() when queued
+  char data[TLV_MAX_PACKET];
+} tlv_txq_entry_t;
+
+typedef struct {
+  tlv_txq_entry_t *entries;
+  uint8_t size, head, count;
+  uint8_t weight;
+  int16_t deficit;
+  // payload from tlv_send_large, sent after the queued frames
+  char *large;                              // large_buf while a payload is going out, else NULL
+  char *large_buf;                          // TLV_MAX_LARGE bytes, allocated on first use and kept
+  uint16_t large_len, large_pos;
+  uint8_t large_channel, large_seq;
+  bool large_frag;                          // send TLV_FRAG fragments, else plain frames
+  uint32_t large_queued;
+} tlv_txq_t;
+
+static tlv_txq_entry_t tlv_txq_pool[TLV_TXQ_ENTRIES];
+static tlv_txq_t tlv_txq[TLV_TXQ_COUNT];
+static tlv_queue_stats_t tlv_txq_stats[TLV_TXQ_COUNT];
+static uint8_t tlv_drr_cur;                 // bulk queue the round robin is at
+static bool tlv_drr_fresh = true;           // tlv_drr_cur hasn't had its quantum yet
+static tlv_txq_entry_t tlv_frag_entry;      // next piece of a large payload
+static uint8_t tlv_frag_payload;            // payload bytes in tlv_frag_entry
+static uint8_t tlv_tx_task;                 // posted by the uart once bulk frames fit again
+
+static void ICACHE_FLASH_ATTR tlv_wake(void);
+
+static void ICACHE_FLASH_ATTR tlv_tx_run(os_event_t *events) {
+  tlv_wake();
+}
+
+static void ICACHE_FLASH_ATTR tlv_txq_init(void) {
+  static const uint8_t sizes[] = TLV_TXQ_SIZES, weights[] = TLV_TXQ_WEIGHTS;
+  tlv_tx_task = register_usr_task_prio(tlv_tx_run, USR_TASK_PRIO_UART, "tlv tx");
+  tlv_txq_entry_t *e = tlv_txq_pool;
+  for (uint8_t q=0; q<TLV_TXQ_COUNT; q++) {
+    tlv_txq[q].entries = e;
+    tlv_txq[q].size = sizes[q];
+    tlv_txq[q].weight = weights[q];
+    e += sizes[q];
+  }
+}
+
+static tlv_channel_t * ICACHE_FLASH_ATTR tlv_channel(uint8_t channel, bool create) {
+  if (tlv_slot[channel] != 0) return &tlv_chan[tlv_slot[channel]-1];
+  if (!create) return NULL;
+  if (tlv_nchan == TLV_MAX_CHANNELS) {
+    os_printf("TLV: no slot for channel %d\n", channel);
+    return NULL;
+  }
+  tlv_channel_t *ch = &tlv_chan[tlv_nchan++];
+  ch->channel = channel;
+  ch->wake_task = TLV_NO_TASK;
+  tlv_slot[channel] = tlv_nchan;
+  return ch;
+}
+
+// the counters for a channel, those without a slot share tlv_other_stats: creating slots here
+// would let garbage channel numbers and TLV_FRAG use up the registry
+static tlv_chan_stats_t * ICACHE_FLASH_ATTR tlv_stats_for(uint8_t channel) {
+  tlv_channel_t *ch = tlv_channel(channel, false);
+  return ch != NULL ? &ch->stats : &tlv_other_stats;
+}
+
+uint8_t ICACHE_FLASH_ATTR tlv_stats_channels(void) {
+  return tlv_nchan;
+}
+
+const tlv_chan_stats_t * ICACHE_FLASH_ATTR tlv_stats_channel(uint8_t i, uint8_t *channel) {
+  if (i >= tlv_nchan) {
+    *channel = 0xFF;
+    return &tlv_other_stats;
+  }
+  *channel = tlv_chan[i].channel;
+  return &tlv_chan[i].stats;
+}
+
+// the send window closed / opened again
+static void ICACHE_FLASH_ATTR tlv_paused(void) {
+  if (tlv_paused_since != 0) return;
+  tlv_paused_since = system_get_time() | 1; // never 0
+  tlv_link_stats.pauses++;
+}
+
+static void ICACHE_FLASH_ATTR tlv_resumed(void) {
+  if (tlv_paused_since == 0) return;
+  uint32_t us = system_get_time() - tlv_paused_since;
+  tlv_paused_since = 0;
+  tlv_paused_rem_us += us;
+  tlv_link_stats.paused_ms += tlv_paused_rem_us / 1000;
+  tlv_paused_rem_us %= 1000;
+  uint8_t b = 0;
+  while (b < TLV_RESUME_BUCKETS-1 && us >= tlv_resume_bucket_ms[b]*1000) b++;
+  tlv_link_stats.resume_hist[b]++;
+}
+
+static tlv_txq_t * ICACHE_FLASH_ATTR tlv_txq_for(uint8_t channel) {
+  if (tlv_txq[0].entries == NULL) tlv_txq_init();
+  return &tlv_txq[channel < TLV_TXQ_COUNT ? channel : TLV_TXQ_COUNT-1];
+}
+
+#define tlv_txq_pending(q) ((q)->count > 0 || (q)->large != NULL)
+
+// the next frame queue q has to send, the queued frames come before a large payload
+static tlv_txq_entry_t * ICACHE_FLASH_ATTR tlv_txq_next(tlv_txq_t *q) {
+  if (q->count > 0) return &q->entries[q->head];
+  tlv_txq_entry_t *e = &tlv_frag_entry;
+  uint16_t left = q->large_len - q->large_pos;
+  uint8_t hdr = 0;
+  e->queued = q->large_queued;
+  e->channel = q->large_channel;
+  if (q->large_frag) {
+    bool first = q->large_pos == 0;
+    hdr = first ? TLV_FRAG_FIRST_HDR : TLV_FRAG_HDR;
+    e->channel = TLV_FRAG;
+    e->data[0] = q->large_channel;
+    e->data[1] = q->large_seq;
+    e->data[2] = (first ? TLV_FRAG_FIRST : 0) | (left <= TLV_MAX_PACKET - hdr ? TLV_FRAG_LAST : 0);
+    if (first) {
+      e->data[3] = q->large_len & 0xFF;
+      e->data[4] = q->large_len >> 8;
+    }
+  }
+  tlv_frag_payload = left > TLV_MAX_PACKET - hdr ? TLV_MAX_PACKET - hdr : left;
+  os_memcpy(e->data + hdr, q->large + q->large_pos, tlv_frag_payload);
+  e->len = hdr + tlv_frag_payload;
+  return e;
+}
+
+// done with the frame tlv_txq_next returned
+static void ICACHE_FLASH_ATTR tlv_txq_pop(tlv_txq_t *q) {
+  if (q->count > 0) {
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+    return;
+  }
+  q->large_pos += tlv_frag_payload;
+  q->large_seq++;
+  if (q->large_pos == q->large_len)
+    q->large = NULL;
+}
+
+// pick the queue that gets the next send slot, or NULL if all are empty
+static tlv_txq_t * ICACHE_FLASH_ATTR tlv_txq_pick(void) {
+  for (uint8_t q=0; q<TLV_TXQ_FIRST_BULK; q++)
+    if (tlv_txq_pending(&tlv_txq[q])) return &tlv_txq[q];
+
+  const uint8_t nbulk = TLV_TXQ_COUNT - TLV_TXQ_FIRST_BULK;
+  for (uint8_t i=0; i<=nbulk; i++) {
+    tlv_txq_t *q = &tlv_txq[TLV_TXQ_FIRST_BULK + tlv_drr_cur];
+    if (tlv_txq_pending(q)) {
+      if (tlv_drr_fresh) {
+        q->deficit += q->weight * TLV_FRAME_COST;
+        tlv_drr_fresh = false;
+      }
+      if (q->deficit >= tlv_txq_next(q)->len + 5) return q;
+    } else {
+      q->deficit = 0;
+    }
+    tlv_drr_cur = (tlv_drr_cur + 1) % nbulk;
+    tlv_drr_fresh = true;
+  }
+  return NULL;
+}
+
+// true if the MCU and the uart can take a frame of len bytes now
+static bool ICACHE_FLASH_ATTR tlv_window_open(uint8_t len) {
+  if (tlv_baud_state == BAUD_SWITCH || tlv_baud_state == BAUD_TEST)
+    return false; // link is changing speed
+  if (tlv_is_send_paused()) {
+    DBG_RATE(10*1000*1000, "Flow control active while sending\n");
+    return false;
+  }
+  return uart0_tx_free() >= len + 5; // room for the largest frame overhead
+}
+
+// send queued frames as long as the send window is open
+static void ICACHE_FLASH_ATTR tlv_pump(void) {
+  tlv_txq_t *q;
+  while ((q = tlv_txq_pick()) != NULL) {
+    tlv_txq_entry_t *e = tlv_txq_next(q);
+    if (!tlv_window_open(e->len)) break;
+    if (q->weight > 0 && uart0_tx_pending() >= TLV_FRAME_COST) {
+      // keep the uart short of bulk data, come back once it has drained
+      uart0_tx_notify(TLV_FRAME_COST-1, tlv_tx_task);
+      break;
+    }
+    DBG_RATE(10*1000*1000, "Sending packet, channel %d, length %d\n", e->channel, e->len);
+
+    tlv_write_frame(e->channel, e->data, e->len);
+    if (tlv_credit_mode)
+      tlv_credits--;
+    else
+      tlv_send_flow_paused = true;
+    if (tlv_is_send_paused()) tlv_paused();
+    tlv_chan_stats_t *cs = tlv_stats_for(e->channel);
+    cs->tx_frames++;
+    cs->tx_bytes += e->len;
+
+    tlv_queue_stats_t *st = &tlv_txq_stats[q - tlv_txq];
+    uint32_t wait = system_get_time() - e->queued;
+    st->sent++;
+    st->wait_total_us += wait;
+    if (wait > st->wait_max_us) st->wait_max_us = wait;
+    if (q->weight > 0) q->deficit -= e->len + 5;
+    tlv_txq_pop(q);
+    st->depth = q->count;
+  }
+}
+
+// post the tasks of all blocked channels, the send window has opened
+static void ICACHE_FLASH_ATTR tlv_wake(void) {
+  tlv_pump();
+  for (uint8_t i=0; i<tlv_nchan; i++) {
+    if (tlv_chan[i].blocked && tlv_chan[i].wake_task != TLV_NO_TASK)
+      post_usr_task(tlv_chan[i].wake_task, 0);
+    tlv_chan[i].blocked = false;
+  }
+}
+
+// Stall detector: the send window only opens on FLOW or CREDIT messages from the MCU. If it has
+// been shut for TLV_STALL_MS while nothing at all came from the MCU, the message that should
+// have opened it was most likely lost, so reopen it by one frame. An explicit pause is left alone.
+static void ICACHE_FLASH_ATTR tlv_stall_check(void) {
+  uint32_t now = system_get_time();
+  if (!tlv_is_send_paused() || tlv_flow_held || tlv_paused_since == 0) return;
+  if (now - tlv_paused_since < TLV_STALL_MS*1000 || now - lastUart < TLV_STALL_MS*1000) return;
+  tlv_stalls++;
+  DBG("TLV: send window stuck for %ldms, resuming\n", (now - tlv_paused_since) / 1000);
+  if (tlv_credit_mode)
+    tlv_credits = 1;
+  else
+    tlv_send_flow_paused = false;
+  tlv_resumed();
+}
+
+static void ICACHE_FLASH_ATTR tlv_block(tlv_channel_t *ch, uint32_t ms);
+
+static void ICACHE_FLASH_ATTR tlv_wake_timer_cb(void *arg) {
+  tlv_wake_armed = false;
+  tlv_stall_check();
+  tlv_wake();
+  // frames still waiting on a shut window: keep checking, or the stall detector never runs
+  if (tlv_is_send_paused()) {
+    for (uint8_t q=0; q<TLV_TXQ_COUNT; q++) {
+      if (tlv_txq_pending(&tlv_txq[q])) {
+        tlv_block(NULL, 50);
+        break;
+      }
+    }
+  }
+}
+
+// remember that channel is waiting for the send window, the uart tx ring draining doesn't
+// generate a message so that is covered by a short timer, a flow pause by a longer one which
+// runs the stall detector
+static void ICACHE_FLASH_ATTR tlv_block(tlv_channel_t *ch, uint32_t ms) {
+  if (ch != NULL) ch->blocked = true;
+  if (!tlv_wake_armed) {
+    tlv_wake_armed = true;
+    os_timer_disarm(&tlv_wake_timer);
+    os_timer_setfn(&tlv_wake_timer, tlv_wake_timer_cb, NULL);
+    os_timer_arm(&tlv_wake_timer, ms, 0);
+  }
+}
+
+void ICACHE_FLASH_ATTR tlv_register_wakeup(uint8_t channel, uint8_t task) {
+  tlv_channel_t *ch = tlv_channel(channel, true);
+  if (ch != NULL) ch->wake_task = task;
+}
+
+bool ICACHE_FLASH_ATTR tlv_channel_blocked(uint8_t channel) {
+  tlv_channel_t *ch = tlv_channel(channel, false);
+  return ch != NULL && ch->blocked;
+}
+
+void ICACHE_FLASH_ATTR tlv_reschedule(uint8_t channel) {
+  tlv_channel_t *ch = tlv_channel(channel, false);
+  if (ch == NULL || ch->wake_task == TLV_NO_TASK) return;
+  if (ch->blocked)
+    tlv_wakeups_avoided++;
+  else
+    post_usr_task(ch->wake_task, 0);
+}
+
+const tlv_queue_stats_t * ICACHE_FLASH_ATTR tlv_queue_stats(uint8_t channel) {
+  tlv_txq_for(channel); // make sure the queues exist
+  return &tlv_txq_stats[channel < TLV_TXQ_COUNT ? channel : TLV_TXQ_COUNT-1];
+}
+
+// queue a frame for the MCU, returns -1 if the channel's queue is full
 int8_t ICACHE_FLASH_ATTR tlv_send(uint8_t channel, char *buf, uint8_t len)
 {
-  if (tlv_send_flow_paused) {
-    DBG_RATE(10*1000*1000, "Flow control active while sending\n");
-    if (system_get_time() - lastUart > 50*1000) { // 0.05s
-      tlv_poll_uart();
+  if (len > TLV_MAX_PACKET) return -1;
+  tlv_txq_t *q = tlv_txq_for(channel);
+  // frames queue up behind a large payload on the same queue, not next to it
+  if (q->count == q->size || q->large != NULL) {
+    tlv_pump();
+    if (q->count == q->size || q->large != NULL) {
+      tlv_block(tlv_channel(channel, false), tlv_is_send_paused() ? 50 : 2);
+      tlv_stats_for(channel)->rejected++;
+      return -1;
     }
+  }
+
+  tlv_txq_entry_t *e = &q->entries[(q->head + q->count) % q->size];
+  e->channel = channel;
+  e->len = len;
+  e->queued = system_get_time();
+  os_memcpy(e->data, buf, len);
+  tlv_queue_stats_t *st = &tlv_txq_stats[q - tlv_txq];
+  st->depth = ++q->count;
+  if (st->depth > st->max_depth) st->max_depth = st->depth;
+  tlv_channel_t *ch = tlv_channel(channel, false);
+  if (ch != NULL) ch->blocked = false;
+
+  tlv_pump();
+  if (q->count > 0 && !tlv_wake_armed) // nothing may wake us if the window stays shut
+    tlv_block(NULL, tlv_is_send_paused() ? 50 : 2);
+  return 0;
+}
+
+// queue a payload of up to TLV_MAX_LARGE bytes, returns -1 while the previous one on the same
+// queue is still going out
+int8_t ICACHE_FLASH_ATTR tlv_send_large(uint8_t channel, char *buf, uint16_t len)
+{
+  if (len <= TLV_MAX_PACKET) return tlv_send(channel, buf, len);
+  if (len > TLV_MAX_LARGE) return -2;
+  tlv_txq_t *q = tlv_txq_for(channel);
+  if (q->large != NULL) tlv_pump();
+  if (q->large == NULL && q->large_buf == NULL) q->large_buf = heap_malloc(HEAP_TLV, TLV_MAX_LARGE);
+  if (q->large != NULL || q->large_buf == NULL) { // still busy or out of memory, try again later
+    tlv_block(tlv_channel(channel, false), tlv_is_send_paused() ? 50 : 2);
+    tlv_stats_for(channel)->rejected++;
     return -1;
   }
-  DBG_RATE(10*1000*1000, "Sending packet, channel %d, length %d\n", channel, len);
 
-  uart0_write_char((char) channel);
-  uart0_write_char((char) len);
-  uart0_tx_buffer(buf, len);
-  tlv_send_flow_paused = true;
+  os_memcpy(q->large_buf, buf, len);
+  q->large = q->large_buf;
+  q->large_len = len;
+  q->large_pos = 0;
+  q->large_seq = 0;
+  q->large_channel = channel;
+  q->large_frag = (tlv_peer_caps & TLV_CAP_FRAG) != 0;
+  q->large_queued = system_get_time();
+  tlv_channel_t *ch = tlv_channel(channel, false);
+  if (ch != NULL) ch->blocked = false;
+
+  tlv_pump();
+  if (q->large != NULL && !tlv_wake_armed)
+    tlv_block(NULL, tlv_is_send_paused() ? 50 : 2);
   return 0;
 }
 
+static void ICACHE_FLASH_ATTR tlv_baud_timer_cb(void *arg);
+
+static void ICACHE_FLASH_ATTR tlv_baud_arm(uint32_t ms, bool repeat) {
+  os_timer_disarm(&tlv_baud_timer);
+  os_timer_setfn(&tlv_baud_timer, tlv_baud_timer_cb, NULL);
+  os_timer_arm(&tlv_baud_timer, ms, repeat);
+}
+
+static void ICACHE_FLASH_ATTR tlv_baud_msg(uint8_t op, uint32_t rate) {
+  uint8_t msg[] = { TLV_CONTROL_BAUD, op, rate & 0xFF, (rate >> 8) & 0xFF, (rate >> 16) & 0xFF,
+                    rate >> 24 };
+  tlv_send_control(msg, sizeof(msg));
+}
+
+static uint32_t ICACHE_FLASH_ATTR tlv_baud_errors(void) {
+  return tlv_frame_errors.crc_errors + tlv_frame_errors.length_errors + uart0_rx_frame_errors();
+}
+
+// propose the next rate to try, or settle for the configured rate
+static void ICACHE_FLASH_ATTR tlv_baud_next(void) {
+  while (tlv_baud_try < sizeof(tlv_baud_rates)/sizeof(tlv_baud_rates[0])) {
+    uint32_t rate = tlv_baud_rates[tlv_baud_try];
+    if (rate > flashConfig.baud_rate) {
+      tlv_baud_target = rate;
+      tlv_baud_state = BAUD_PROPOSED;
+      tlv_baud_msg(TLV_BAUD_PROPOSE, rate);
+      tlv_baud_arm(TLV_BAUD_TIMEOUT, false);
+      return;
+    }
+    tlv_baud_try++;
+  }
+  DBG("TLV: staying at %ld baud\n", flashConfig.baud_rate);
+  tlv_baud_state = BAUD_IDLE;
+  os_timer_disarm(&tlv_baud_timer);
+}
+
+// change the uart rate once what has been sent so far has gone out at the old rate
+static void ICACHE_FLASH_ATTR tlv_baud_switch(uint32_t rate, uint8_t then) {
+  tlv_baud_target = rate;
+  tlv_baud_then = then;
+  tlv_baud_state = BAUD_SWITCH;
+  tlv_baud_arm(1, true);
+}
+
+// go back to the configured rate, next tries the following rate, else negotiation stops
+static void ICACHE_FLASH_ATTR tlv_baud_fallback(bool next) {
+  DBG("TLV: %ld baud failed\n", tlv_baud_cur ? tlv_baud_cur : tlv_baud_target);
+  tlv_baud_try = next ? tlv_baud_try + 1 : sizeof(tlv_baud_rates)/sizeof(tlv_baud_rates[0]);
+  if (tlv_baud_cur != 0) {
+    tlv_baud_msg(TLV_BAUD_FALLBACK, flashConfig.baud_rate);
+    tlv_baud_switch(flashConfig.baud_rate, BAUD_IDLE);
+  } else {
+    tlv_baud_next();
+  }
+}
+
+static void ICACHE_FLASH_ATTR tlv_baud_timer_cb(void *arg) {
+  switch (tlv_baud_state) {
+  case BAUD_PROPOSED: // no answer
+    tlv_baud_fallback(true);
+    break;
+  case BAUD_SWITCH:
+    if (!uart0_tx_idle()) break;
+    uart0_baud(tlv_baud_target);
+    tlv_baud_cur = tlv_baud_target == flashConfig.baud_rate ? 0 : tlv_baud_target;
+    if (tlv_baud_then == BAUD_TEST) {
+      uint8_t msg[2+sizeof(tlv_baud_pattern)] = { TLV_CONTROL_BAUD, TLV_BAUD_TEST };
+      os_memcpy(msg+2, tlv_baud_pattern, sizeof(tlv_baud_pattern));
+      tlv_send_control(msg, sizeof(msg));
+      tlv_baud_state = BAUD_TEST;
+      tlv_baud_arm(TLV_BAUD_TIMEOUT, false);
+    } else {
+      // back at the configured rate, give the MCU time to get there too before trying again
+      tlv_baud_state = BAUD_IDLE;
+      tlv_baud_arm(2*TLV_BAUD_TIMEOUT, false);
+      tlv_wake();
+    }
+    break;
+  case BAUD_TEST: // no echo
+    tlv_baud_fallback(true);
+    break;
+  case BAUD_IDLE:
+    tlv_baud_next();
+    break;
+  case BAUD_DONE: // watch for errors at the new rate
+    if (tlv_baud_errors() - tlv_baud_errs > TLV_BAUD_MAX_ERRORS) {
+      tlv_baud_fallback(false);
+      break;
+    }
+    tlv_baud_errs = tlv_baud_errors();
+    break;
+  }
+}
+
+static void ICACHE_FLASH_ATTR tlv_baud_control(tlv_data_t *tlv) {
+  uint32_t rate = tlv->length < 6 ? 0 :
+    tlv->data[2] | (tlv->data[3] << 8) | (tlv->data[4] << 16) | ((uint32_t)tlv->data[5] << 24);
+  switch (tlv->data[1]) {
+  case TLV_BAUD_ACCEPT:
+    if (tlv_baud_state != BAUD_PROPOSED || rate != tlv_baud_target) break;
+    tlv_baud_switch(rate, BAUD_TEST);
+    break;
+  case TLV_BAUD_REJECT:
+    if (tlv_baud_state != BAUD_PROPOSED || rate != tlv_baud_target) break;
+    tlv_baud_fallback(true);
+    break;
+  case TLV_BAUD_TEST:
+    if (tlv_baud_state != BAUD_TEST) break;
+    if (tlv->length == 2+sizeof(tlv_baud_pattern) &&
+        os_memcmp(tlv->data+2, tlv_baud_pattern, sizeof(tlv_baud_pattern)) == 0) {
+      os_printf("TLV: link at %ld baud\n", tlv_baud_cur);
+      tlv_baud_msg(TLV_BAUD_CONFIRM, tlv_baud_cur);
+      tlv_baud_state = BAUD_DONE;
+      tlv_baud_errs = tlv_baud_errors();
+      tlv_baud_arm(1000, true);
+      tlv_wake();
+    } else {
+      tlv_baud_fallback(true);
+    }
+    break;
+  }
+}
+
+uint32_t ICACHE_FLASH_ATTR tlv_baud_rate(void) {
+  return tlv_baud_cur ? tlv_baud_cur : flashConfig.baud_rate;
+}
+
+// handle the flow control messages on TLV_CONTROL, they are also passed on to the channel handler
+static void ICACHE_FLASH_ATTR tlv_control(tlv_data_t *tlv) {
+  switch (tlv->data[0]) {
+  case TLV_CONTROL_FLOW:
+    if (tlv->length != 2) break;
+    // DBG("TLV Flow control message: %d\n", tlv->data[1]);
+    if (tlv_credit_mode) {
+      DBG("TLV: flow message in credit mode, back to stop-and-wait\n");
+      tlv_credit_mode = false;
+    }
+    tlv_send_flow_paused = tlv_flow_held = (tlv->data[1] != 0);
+    if (tlv_send_flow_paused) {
+      tlv_paused();
+    } else {
+      tlv_resumed();
+      tlv_wake();
+    }
+    break;
+  case TLV_CONTROL_CAPS:
+    if (tlv->length != 3) break;
+    tlv_peer_caps = tlv->data[1];
+    DBG("TLV: MCU caps 0x%02x\n", tlv_peer_caps);
+    if (!(tlv_peer_caps & TLV_CAP_CREDIT)) tlv_credit_mode = false;
+    if (tlv->data[2] == 0) {
+      uint8_t reply[] = { TLV_CONTROL_CAPS, TLV_CAPS, 1 };
+      tlv_framed = false; // the reply itself always goes out unframed
+      tlv_send_control(reply, sizeof(reply));
+      tlv_framed = (tlv_peer_caps & TLV_CAP_CRC) != 0;
+      tlv_frame_reset();
+      DBG("TLV: %s\n", tlv_framed ? "crc framing" : "unframed");
+      // the MCU (re)started at the configured rate, so are we if we got its message
+      tlv_baud_cur = 0;
+      tlv_baud_try = 0;
+      if (tlv_peer_caps & TLV_CAP_BAUD) tlv_baud_next();
+      else { tlv_baud_state = BAUD_IDLE; os_timer_disarm(&tlv_baud_timer); }
+    }
+    break;
+  case TLV_CONTROL_BAUD:
+    if (tlv->length < 2) break;
+    tlv_baud_control(tlv);
+    break;
+  case TLV_CONTROL_CREDIT:
+    if (tlv->length != 2) break;
+    if (!tlv_credit_mode) {
+      DBG("TLV: credit mode\n");
+      tlv_credit_mode = true;
+      tlv_credits = 0;
+    }
+    tlv_credits = tlv_credits + tlv->data[1] > 255 ? 255 : tlv_credits + tlv->data[1];
+    if (tlv_credits > 0) {
+      tlv_resumed();
+      tlv_wake();
+    }
+    break;
+  }
+}
+
 static tlv_data_t tlv_data;
 static uint8_t tlv_data_read = 0;
 
@@ -61,8 +680,173 @@ static enum {
 	CHANNEL = 0, LENGTH = 1, DATA = 2
 } tlv_read_state = CHANNEL;
 
+// Held frames are offered to their handler again by a timer as well, so a handler that never
+// calls tlv_channel_ready (or calls it before it's really ready) can't wedge its channel
+static void ICACHE_FLASH_ATTR tlv_hold_timer_cb(void *arg) {
+  tlv_hold_armed = false;
+  for (uint8_t i=0; i<tlv_nchan; i++)
+    if (tlv_chan[i].nheld > 0) tlv_channel_ready(tlv_chan[i].channel);
+}
 
-static tlv_receive_cb tlv_cb[TLV_MAX_HANDLERS];
+static void ICACHE_FLASH_ATTR tlv_hold_retry(void) {
+  if (tlv_hold_armed) return;
+  tlv_hold_armed = true;
+  os_timer_disarm(&tlv_hold_timer);
+  os_timer_setfn(&tlv_hold_timer, tlv_hold_timer_cb, NULL);
+  os_timer_arm(&tlv_hold_timer, TLV_HOLD_RETRY_MS, 0);
+}
+
+// tell the MCU to stop or resume sending on a channel, if it knows how
+static void ICACHE_FLASH_ATTR tlv_channel_flow(tlv_channel_t *ch, bool pause) {
+  if (ch->paused == pause) return;
+  ch->paused = pause;
+  DBG("TLV: channel %d %s\n", ch->channel, pause ? "busy" : "ready");
+  if (tlv_peer_caps & TLV_CAP_CHANNEL_FLOW) {
+    uint8_t msg[] = { TLV_CONTROL_CHANNEL_FLOW, ch->channel, pause };
+    tlv_send_control(msg, sizeof(msg));
+  }
+}
+
+// Reassembly of TLV_FRAG fragments from the MCU, one payload per channel at a time. The
+// buffers are allocated when first needed and kept for the next payload.
+#define TLV_REASM_SLOTS 2
+typedef struct {
+  bool busy;
+  uint8_t channel, seq;   // seq of the next fragment
+  uint16_t len, pos;
+  uint8_t *buf;
+} tlv_reasm_t;
+static tlv_reasm_t tlv_reasm[TLV_REASM_SLOTS];
+uint32_t tlv_reasm_errors;
+
+static void tlv_deliver(tlv_data_t *tlv);
+
+// hand a reassembled payload to the channel's large handler, or in pieces to its normal one
+static void ICACHE_FLASH_ATTR
+tlv_deliver_large(uint8_t channel, uint8_t *buf, uint16_t len) {
+  tlv_channel_t *ch = tlv_channel(channel, false);
+  if (ch != NULL && ch->large_cb != NULL) {
+    ch->large_cb(channel, buf, len);
+    return;
+  }
+  static tlv_data_t piece;
+  for (uint16_t pos=0; pos<len; pos+=piece.length) {
+    piece.channel = channel;
+    piece.length = len-pos > TLV_MAX_PACKET ? TLV_MAX_PACKET : len-pos;
+    os_memcpy(piece.data, buf+pos, piece.length);
+    tlv_deliver(&piece);
+  }
+}
+
+static void ICACHE_FLASH_ATTR
+tlv_reassemble(tlv_data_t *tlv) {
+  if (tlv->length < TLV_FRAG_HDR) goto error;
+  uint8_t channel = tlv->data[0], seq = tlv->data[1], flags = tlv->data[2];
+  tlv_reasm_t *r = NULL, *idle = NULL;
+  for (uint8_t i=0; i<TLV_REASM_SLOTS; i++) {
+    if (tlv_reasm[i].busy && tlv_reasm[i].channel == channel) r = &tlv_reasm[i];
+    else if (!tlv_reasm[i].busy && idle == NULL) idle = &tlv_reasm[i];
+  }
+
+  uint8_t hdr = TLV_FRAG_HDR;
+  if (flags & TLV_FRAG_FIRST) {
+    if (r != NULL) { // the previous payload never finished
+      tlv_reasm_errors++;
+      idle = r;
+    }
+    r = idle;
+    hdr = TLV_FRAG_FIRST_HDR;
+    if (r == NULL || tlv->length < hdr) goto error;
+    uint16_t len = tlv->data[3] | (tlv->data[4] << 8);
+    if (len > TLV_MAX_LARGE) goto error;
+    if (r->buf == NULL) r->buf = heap_malloc(HEAP_TLV, TLV_MAX_LARGE);
+    if (r->buf == NULL) goto error;
+    r->busy = true;
+    r->channel = channel;
+    r->seq = seq;
+    r->len = len;
+    r->pos = 0;
+  } else if (r == NULL) {
+    goto error;
+  }
+
+  uint8_t n = tlv->length - hdr;
+  if (seq != r->seq || r->pos + n > r->len) {
+    r->busy = false;
+    goto error;
+  }
+  os_memcpy(r->buf + r->pos, tlv->data + hdr, n);
+  r->pos += n;
+  r->seq++;
+  if (flags & TLV_FRAG_LAST) {
+    r->busy = false;
+    if (r->pos != r->len) goto error;
+    tlv_deliver_large(channel, r->buf, r->len);
+  }
+  return;
+
+error:
+  tlv_reasm_errors++;
+}
+
+// act on a complete frame from the MCU
+static void ICACHE_FLASH_ATTR
+tlv_deliver(tlv_data_t *tlv) {
+  tlv_chan_stats_t *cs = tlv_stats_for(tlv->channel);
+  cs->rx_frames++;
+  cs->rx_bytes += tlv->length;
+  if (tlv->channel == TLV_CONTROL && tlv->length > 0) {
+    tlv_control(tlv);
+  }
+  if (tlv->channel == TLV_FRAG) {
+    tlv_reassemble(tlv);
+    return;
+  }
+  // channels without a handler go to the channel 0 handler
+  tlv_channel_t *ch = tlv_channel(tlv->channel, false);
+  if (ch == NULL || ch->cb == NULL) ch = tlv_channel(TLV_CONTROL, false);
+  if (ch == NULL || ch->cb == NULL) return;
+
+  // keep the order, frames wait behind any the handler hasn't taken yet
+  if (ch->nheld == 0 && ch->cb(tlv) != TLV_BUSY) return;
+
+  if (ch->held == NULL) ch->held = heap_malloc(HEAP_TLV, TLV_HOLD_FRAMES * sizeof(tlv_data_t));
+  if (ch->held == NULL || ch->nheld == TLV_HOLD_FRAMES) {
+    tlv_busy_drops++;
+    return;
+  }
+  os_memcpy(&ch->held[ch->nheld++], tlv, sizeof(tlv_data_t));
+  tlv_channel_flow(ch, true);
+  tlv_hold_retry();
+}
+
+void ICACHE_FLASH_ATTR tlv_channel_ready(uint8_t channel) {
+  tlv_channel_t *ch = tlv_channel(channel, false);
+  if (ch == NULL || ch->cb == NULL) return;
+  while (ch->nheld > 0) {
+    if (ch->cb(&ch->held[0]) == TLV_BUSY) {
+      tlv_hold_retry();
+      return;
+    }
+    ch->nheld--;
+    os_memmove(&ch->held[0], &ch->held[1], ch->nheld * sizeof(tlv_data_t));
+  }
+  tlv_channel_flow(ch, false);
+}
+
+// a good frame from the CRC framed receiver
+void ICACHE_FLASH_ATTR
+tlv_frame_deliver(tlv_data_t *tlv) {
+  tlv_tap_frame(TLV_TAP_RX, tlv->channel, (char *) tlv->data, tlv->length);
+  tlv_deliver(tlv);
+}
+
+// feed the CRC framed receiver, whatever is left if it falls back is parsed unframed
+static void ICACHE_FLASH_ATTR
+tlv_frame_input(char *buf, short length) {
+  short used = tlv_frame_rx((uint8_t *) buf, length);
+  if (used < length) tlvUartCb(buf+used, length-used);
+}
 
 // callback with a buffer of characters that have arrived on the uart
 void ICACHE_FLASH_ATTR
@@ -71,6 +855,11 @@ tlvUartCb(char *buf, short length) {
   short pos = 0;
   uint8_t read;
 
+  if (tlv_framed) {
+    tlv_frame_input(buf, length);
+    return;
+  }
+
   if (length < 4) { DBG("tlvUartCb: %d bytes\n", length); }
   while (pos < length) {
     switch (tlv_read_state) {
@@ -98,23 +887,14 @@ tlvUartCb(char *buf, short length) {
 
       if (tlv_data_read == tlv_data.length) {
         // DBG("Complete packet read, channel %d, length %d at %d of %d\n", tlv_data.channel, tlv_data.length, pos, length);
-
-        if (tlv_data.channel == TLV_CONTROL) {
-          if (tlv_data.data[0] == TLV_CONTROL_FLOW && tlv_data.length == 2) {
-            // DBG("TLV Flow control message: %d\n", tlv_data.data[1]);
-            tlv_send_flow_paused = (tlv_data.data[1] != 0);
-          }
-        }
-        tlv_receive_cb cb;
-        if (tlv_data.channel < TLV_MAX_HANDLERS) {
-          cb = tlv_cb[tlv_data.channel];
-        } else {
-          cb = tlv_cb[0];
-        }
-        if (cb != NULL) {
-          cb(&tlv_data);
-        }
         tlv_read_state = CHANNEL;
+        tlv_tap_frame(TLV_TAP_RX, tlv_data.channel, (char *) tlv_data.data, tlv_data.length);
+        tlv_deliver(&tlv_data);
+        if (tlv_framed) {
+          // the CAPS exchange switched on framing, the rest is framed
+          tlv_frame_input(buf+pos, length-pos);
+          return;
+        }
       }
       break;
     }
@@ -122,21 +902,13 @@ tlvUartCb(char *buf, short length) {
 }
 
 void ICACHE_FLASH_ATTR tlv_register_channel_handler(uint8_t channel, tlv_receive_cb cb) {
-  if (channel < TLV_MAX_HANDLERS) {
-    tlv_cb[channel] = cb;
-  }
+  tlv_channel_t *ch = tlv_channel(channel, true);
+  if (ch != NULL) ch->cb = cb;
 }
 
-void ICACHE_FLASH_ATTR tlv_poll_uart() {
-  char recv[1];
-
-  uint16_t got;
-  while ((got = uart0_rx_poll(recv, 1, 100)) == 1) {
-    // feed the watchdog
-    system_soft_wdt_feed();
-    DBG("poll\n");
-    tlvUartCb(recv, got);
-  }
+void ICACHE_FLASH_ATTR tlv_register_large_handler(uint8_t channel, tlv_large_cb cb) {
+  tlv_channel_t *ch = tlv_channel(channel, true);
+  if (ch != NULL) ch->large_cb = cb;
 }
 
 void ICACHE_FLASH_ATTR tlv_init() {
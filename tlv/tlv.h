@@ -3,7 +3,7 @@
 
 #include <esp8266.h>
 
-#define TLV_MAX_HANDLERS 4
+#define TLV_MAX_CHANNELS 16 // channels that can have a handler or wakeup registered
 #define TLV_MAX_PACKET 64
 
 #define TLV_CONTROL 0
@@ -13,6 +13,104 @@
 
 #define TLV_CONTROL_FLOW 0
 #define TLV_CONTROL_CONNECT 1
+#define TLV_CONTROL_CAPS 2
+#define TLV_CONTROL_CREDIT 3
+#define TLV_CONTROL_CHANNEL_FLOW 4
+#define TLV_CONTROL_BAUD 5
+
+/* Flow control of frames sent to the MCU.
+ * Stop-and-wait (original MCU firmware): after each frame esp-link waits for a
+ *   [TLV_CONTROL_FLOW, 0] message before sending the next one, [TLV_CONTROL_FLOW, 1] pauses.
+ * Credits: the MCU announces [TLV_CONTROL_CAPS, caps, 0] when it starts up (and after it sees
+ *   esp-link boot), esp-link answers with [TLV_CONTROL_CAPS, caps, 1]. If both have
+ *   TLV_CAP_CREDIT the MCU then sends [TLV_CONTROL_CREDIT, n] whenever it has n more receive
+ *   buffers available and esp-link sends one frame per credit, on any channel, without waiting
+ *   for a round trip. Receiving a TLV_CONTROL_FLOW message (e.g. because the MCU was reset into
+ *   old firmware) reverts esp-link to stop-and-wait.
+ */
+#define TLV_CAP_CREDIT (1<<0)
+#define TLV_CAP_CRC (1<<1)
+#define TLV_CAP_CHANNEL_FLOW (1<<2)
+#define TLV_CAP_FRAG (1<<3)
+#define TLV_CAP_BAUD (1<<4)
+#define TLV_CAPS (TLV_CAP_CREDIT|TLV_CAP_CRC|TLV_CAP_CHANNEL_FLOW|TLV_CAP_FRAG|TLV_CAP_BAUD) // what this esp-link supports
+
+/* Baud rate negotiation, if the MCU has TLV_CAP_BAUD. Messages are [TLV_CONTROL_BAUD, op, rate
+ * as 4 bytes little endian], except TEST. After the CAPS exchange esp-link proposes the rates
+ * above the configured one, highest first:
+ * - esp-link sends PROPOSE, the MCU answers ACCEPT or REJECT with the same rate.
+ * - After ACCEPT both sides switch once their tx is drained, esp-link then sends
+ *   [TLV_CONTROL_BAUD, TEST, pattern...] which the MCU echoes back unchanged.
+ * - If the echo matches esp-link sends CONFIRM. An MCU that hasn't seen CONFIRM within
+ *   2*TLV_BAUD_TIMEOUT ms of switching goes back to the configured rate, and so does esp-link
+ *   if the echo is missing or wrong, then it proposes the next lower rate.
+ * - Once running at the new rate esp-link sends FALLBACK and returns to the configured rate when
+ *   it sees more than TLV_BAUD_MAX_ERRORS errors in a second; the MCU should follow either way.
+ * An MCU reset is noticed through its CAPS message at the configured rate.
+ */
+#define TLV_BAUD_PROPOSE 0
+#define TLV_BAUD_ACCEPT 1
+#define TLV_BAUD_REJECT 2
+#define TLV_BAUD_TEST 3
+#define TLV_BAUD_CONFIRM 4
+#define TLV_BAUD_FALLBACK 5
+#define TLV_BAUD_TIMEOUT 200
+#define TLV_BAUD_MAX_ERRORS 4
+
+/* Fragmentation: payloads of up to TLV_MAX_LARGE bytes travel as a series of frames on the
+ * TLV_FRAG channel, each [channel, seq, flags, data...]. The first fragment has TLV_FRAG_FIRST
+ * set and the total length (little endian) after the flags, the last one TLV_FRAG_LAST, seq goes
+ * up by one per fragment. Fragments of different channels may interleave but each channel has
+ * one payload in flight. esp-link only sends fragments to an MCU with TLV_CAP_FRAG, otherwise
+ * a large payload goes out as plain frames on its channel and loses its boundaries.
+ */
+#define TLV_FRAG 0xFE
+#define TLV_FRAG_FIRST (1<<0)
+#define TLV_FRAG_LAST (1<<1)
+#define TLV_FRAG_HDR 3
+#define TLV_FRAG_FIRST_HDR 5
+#define TLV_MAX_LARGE 2048
+
+/* Per channel flow control of frames sent by the MCU: when the handler for a channel is busy
+ * esp-link sends [TLV_CONTROL_CHANNEL_FLOW, channel, 1] and holds on to what arrives for that
+ * channel (up to TLV_HOLD_FRAMES), [TLV_CONTROL_CHANNEL_FLOW, channel, 0] once the handler has
+ * caught up. Only sent to an MCU that announced TLV_CAP_CHANNEL_FLOW.
+ */
+
+/* CRC framing: if both sides have TLV_CAP_CRC, every frame following esp-link's CAPS reply is
+ * sent as [TLV_SOF, channel, length, data..., crc lo, crc hi] in both directions. The CRC is
+ * crc16_data() (serial/crc16.c) over channel, length and data. A receiver that sees a bad
+ * length or CRC drops the SOF byte and hunts for the next one, so it is back in sync within a
+ * frame. After TLV_CRC_FALLBACK bad frames in a row esp-link assumes the MCU was reset and goes
+ * back to unframed until the next CAPS exchange.
+ */
+#define TLV_SOF 0xA5
+#define TLV_CRC_FALLBACK 16
+
+/* HID reports sent to the MCU on TLV_HID. The two original reports are recognised by their
+ * length and carry no report id, all other reports start with one of the ids below.
+ *   length 2: keyboard [modifiers, usage]
+ *   length 4: relative mouse [buttons, dx, dy, wheel], deltas are int8
+ * Multi-byte values are little endian.
+ */
+// absolute pointer [id, buttons, x lo, x hi, y lo, y hi, wheel], x and y are scaled to
+// 0..TLV_HID_ABS_MAX over the full VNC framebuffer, wheel is an int8 delta
+#define TLV_HID_ABS_POINTER 0x10
+#define TLV_HID_ABS_POINTER_LEN 7
+#define TLV_HID_ABS_MAX 0x7FFF
+// keyboard changes [id, modifiers, usage]: only what changed is sent, the MCU keeps the state
+// of all keys and can present it to the host as a 6KRO boot report or as an NKRO bitmap.
+// A usage of 0 only updates the modifiers.
+#define TLV_HID_KEY_DOWN 0x20
+#define TLV_HID_KEY_UP 0x21
+#define TLV_HID_KEY_LEN 3
+// full keyboard state [id, modifiers, 32 byte bitmap of pressed usages, bit n%8 of byte n/8],
+// sent when a VNC client connects and whenever the state gets reset
+#define TLV_HID_KEY_STATE 0x22
+#define TLV_HID_KEY_STATE_LEN 34
+// several reports in one frame [id, len 1, report 1, len 2, report 2, ...], each report is
+// exactly what would otherwise have been sent in a frame of its own, in the same order
+#define TLV_HID_BATCH 0x30
 
 typedef struct {
 	uint8_t channel;
@@ -24,24 +122,98 @@ void ICACHE_FLASH_ATTR
 tlvUartCb(char *buf, short length);
 
 /** Callback used when registering the handler for incoming data
- *  The channel number is a 1-based channel sequence
- *  Channel 0 is the default handler for any channels greater than TLV_MAX_CHANNELS
- *  It should return a true or false to indicate whether the message could be consumed or not
- *  this is intended to be used as a sort of flow control mechanism, but needs to be properly thought through!
+ *  Any channel 0-255 can have a handler, up to TLV_MAX_CHANNELS of them
+ *  Channel 0 is the default handler for any channels without a handler of their own
+ *  It returns TLV_BUSY if it can't take the frame now, TLV then holds the frame, asks the MCU
+ *  to pause the channel and delivers the frame again once tlv_channel_ready is called, or
+ *  after a short timeout if that call doesn't come
  */
+#define TLV_BUSY -1
 typedef int8_t (*tlv_receive_cb)(tlv_data_t *tlv_data);
 
+// Callback for reassembled payloads, data is only valid during the call
+typedef void (*tlv_large_cb)(uint8_t channel, uint8_t *data, uint16_t len);
+void tlv_register_large_handler(uint8_t channel, tlv_large_cb cb);
+extern uint32_t tlv_reasm_errors; // fragments dropped due to a gap or bad header
+
+// A busy handler is ready to take frames again
+void tlv_channel_ready(uint8_t channel);
+extern uint32_t tlv_busy_drops; // frames dropped because a busy handler's hold was full
+
 /**
+ * Queues a frame for the MCU, frames go out in priority order as the MCU's send window opens.
  * Returns 0 if successful, non-zero if not
- * -1 indicates that the uart has been blocked
- * -2 indicates that the channel has been blocked
+ * -1 indicates that the channel's transmit queue is full
  *
  * In the event of a blocked transmission, action should be taken to
- * send the tlv at a later time, typically by posting a task using post_user_task
+ * send the tlv at a later time, typically by calling tlv_reschedule
  **/
 int8_t ICACHE_FLASH_ATTR tlv_send(uint8_t channel, char *buf, uint8_t len);
+
+// Queue a payload of up to TLV_MAX_LARGE bytes, fragmented if the MCU supports it. Returns -1
+// while a previous large payload on the same channel is still being sent, -2 if too long.
+int8_t tlv_send_large(uint8_t channel, char *buf, uint16_t len);
 void ICACHE_FLASH_ATTR tlv_register_channel_handler(uint8_t channel, tlv_receive_cb cb);
 
 bool tlv_is_send_paused(void);
 
+// a send window that stays shut this long without any input from the MCU is reopened
+#define TLV_STALL_MS 500
+extern uint32_t tlv_stalls;
+
+// current rate of the link to the MCU
+uint32_t tlv_baud_rate(void);
+
+/* Send window wakeups: a deferred task that finds tlv_send refusing data for a channel should
+ * not repost itself. Instead it registers for the channel once and calls tlv_reschedule when it
+ * has data left over, which posts the task right away if the channel can take data, and
+ * otherwise leaves it to TLV to post the task when the MCU opens the send window again.
+ */
+void tlv_register_wakeup(uint8_t channel, uint8_t task);
+bool tlv_channel_blocked(uint8_t channel);
+void tlv_reschedule(uint8_t channel);
+extern uint32_t tlv_wakeups_avoided; // reposts saved while a channel was blocked
+
+// Transmit queue statistics, channels above TLV_DEBUG share the TLV_DEBUG queue
+#define TLV_TXQ_COUNT 4
+typedef struct {
+  uint8_t  depth, max_depth;  // frames queued now and at most
+  uint32_t sent;              // frames sent
+  uint32_t wait_total_us;     // summed time frames spent queued
+  uint32_t wait_max_us;       // longest time a frame spent queued
+} tlv_queue_stats_t;
+const tlv_queue_stats_t *tlv_queue_stats(uint8_t channel);
+
+// Per channel traffic counters
+typedef struct {
+  uint32_t tx_frames, tx_bytes;
+  uint32_t rx_frames, rx_bytes;
+  uint32_t rejected;          // tlv_send/tlv_send_large calls refused with -1
+} tlv_chan_stats_t;
+// number of channels with counters (those with a handler or wakeup registered), and the
+// counters of the i-th one; past the last one the counters of all other channels are returned
+// with channel 0xFF
+uint8_t tlv_stats_channels(void);
+const tlv_chan_stats_t *tlv_stats_channel(uint8_t i, uint8_t *channel);
+
+// Send window counters: a pause is each time the MCU's window closes, after every frame in
+// stop-and-wait mode, the resume histogram counts how long it took to open again
+#define TLV_RESUME_BUCKETS 8
+typedef struct {
+  uint32_t pauses;
+  uint32_t paused_ms;         // total time the window was closed
+  uint32_t resume_hist[TLV_RESUME_BUCKETS];
+} tlv_link_stats_t;
+extern tlv_link_stats_t tlv_link_stats;
+extern const uint16_t tlv_resume_bucket_ms[TLV_RESUME_BUCKETS-1]; // upper bucket bounds
+
+// receive error counters for the CRC framed mode
+typedef struct {
+  uint32_t crc_errors;    // frames dropped due to a CRC mismatch
+  uint32_t length_errors; // frames dropped due to an impossible length
+  uint32_t skipped;       // bytes discarded while hunting for a start of frame
+  uint32_t resyncs;       // times the receiver had to hunt for a start of frame
+} tlv_frame_errors_t;
+extern tlv_frame_errors_t tlv_frame_errors;
+
 #endif /* __TLV_H__ */
@@ -0,0 +1,92 @@
+// CRC framed TLV receiver, see tlvframe.h
+
+#include <esp8266.h>
+#include "crc16.h"
+#include "tlvframe.h"
+
+bool tlv_framed = false;
+tlv_frame_errors_t tlv_frame_errors;
+
+// rx_frame collects a frame starting with TLV_SOF. When a frame turns out to be bad its SOF is
+// dropped and the bytes after it are parsed again from rx_replay, so a false SOF in the middle
+// of a corrupted frame doesn't cost the real frame that follows it.
+#define TLV_FRAME_MAX (TLV_MAX_PACKET+5)
+static uint8_t rx_frame[TLV_FRAME_MAX];
+static uint8_t rx_frame_len;
+static uint8_t rx_replay[2*TLV_FRAME_MAX];
+static uint8_t rx_replay_len, rx_replay_pos;
+static uint8_t rx_bad_frames; // consecutive bad frames
+static tlv_data_t rx_data;
+
+void ICACHE_FLASH_ATTR
+tlv_frame_reset(void) {
+  rx_frame_len = rx_replay_len = rx_replay_pos = rx_bad_frames = 0;
+}
+
+static void ICACHE_FLASH_ATTR
+tlv_frame_resync(void) {
+  uint8_t sof = 1;
+  while (sof < rx_frame_len && rx_frame[sof] != TLV_SOF) sof++;
+  tlv_frame_errors.resyncs++;
+  tlv_frame_errors.skipped += sof;
+  // the bytes from the next SOF on get parsed again, ahead of any replay still pending
+  uint8_t again = rx_frame_len - sof;
+  uint8_t rest = rx_replay_len - rx_replay_pos;
+  if (again + rest > sizeof(rx_replay)) {
+    tlv_frame_errors.skipped += again + rest - sizeof(rx_replay);
+    rest = sizeof(rx_replay) - again;
+  }
+  os_memmove(rx_replay + again, rx_replay + rx_replay_pos, rest);
+  os_memcpy(rx_replay, rx_frame + sof, again);
+  rx_replay_len = again + rest;
+  rx_replay_pos = 0;
+  rx_frame_len = 0;
+
+  if (++rx_bad_frames >= TLV_CRC_FALLBACK) {
+    os_printf("TLV: no valid frame in a while, back to unframed\n");
+    tlv_framed = false;
+    tlv_frame_reset();
+  }
+}
+
+static void ICACHE_FLASH_ATTR
+tlv_frame_byte(uint8_t b) {
+  if (rx_frame_len == 0 && b != TLV_SOF) {
+    tlv_frame_errors.skipped++;
+    return;
+  }
+  rx_frame[rx_frame_len++] = b;
+  if (rx_frame_len < 3) return;
+  if (rx_frame[2] > TLV_MAX_PACKET) {
+    tlv_frame_errors.length_errors++;
+    tlv_frame_resync();
+    return;
+  }
+  if (rx_frame_len < rx_frame[2] + 5) return;
+
+  uint16_t crc = crc16_data(rx_frame+1, rx_frame_len-3, 0);
+  if ((crc & 0xFF) != rx_frame[rx_frame_len-2] || (crc >> 8) != rx_frame[rx_frame_len-1]) {
+    tlv_frame_errors.crc_errors++;
+    tlv_frame_resync();
+    return;
+  }
+  rx_frame_len = 0;
+  rx_bad_frames = 0;
+  rx_data.channel = rx_frame[1];
+  rx_data.length = rx_frame[2];
+  os_memcpy(rx_data.data, rx_frame+3, rx_data.length);
+  tlv_frame_deliver(&rx_data);
+}
+
+short ICACHE_FLASH_ATTR
+tlv_frame_rx(const uint8_t *buf, short length) {
+  short pos = 0;
+  while (tlv_framed && (rx_replay_pos < rx_replay_len || pos < length)) {
+    if (rx_replay_pos < rx_replay_len) {
+      tlv_frame_byte(rx_replay[rx_replay_pos++]);
+    } else {
+      tlv_frame_byte(buf[pos++]);
+    }
+  }
+  return pos;
+}
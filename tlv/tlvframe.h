@@ -0,0 +1,19 @@
+#ifndef TLVFRAME_H
+#define TLVFRAME_H
+
+#include "tlv.h"
+
+/* Receiver for the CRC framed mode of the TLV link (see tlv.h). It only needs crc16.c, so it
+ * also builds on the host for test/tlv_frame_test.c.
+ */
+extern bool tlv_framed;   // frames carry SOF and CRC in both directions
+
+// forget any partial frame, for when framing gets switched on
+void tlv_frame_reset(void);
+// parse buf while framing stays on, returns the bytes used: fewer than length if the receiver
+// gave up and fell back to unframed, the rest is then unframed data
+short tlv_frame_rx(const uint8_t *buf, short length);
+// gets each good frame, provided by tlv.c
+void tlv_frame_deliver(tlv_data_t *tlv);
+
+#endif
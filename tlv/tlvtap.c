@@ -0,0 +1,165 @@
+// TLV traffic tap, see tlvtap.h
+
+#include <esp8266.h>
+#include <espconn.h>
+#include "tlvtap.h"
+#include "heapstat.h"
+
+#ifdef TLV_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#define TAP_RING 4096      // power of two, allocated while a client is connected
+#define TAP_RING_MASK (TAP_RING-1)
+#define TAP_HDR 7          // time, dir, channel, length
+#define TAP_FLUSH_MS 10    // gather records for this long before sending
+
+static const char tap_magic[8] = { 'T', 'L', 'V', 'T', 'A', 'P', 1, 0 };
+
+static struct espconn tap_listen;
+static esp_tcp tap_tcp;
+static struct espconn *tap_conn;  // the connected client, NULL if none
+
+// records are appended at tap_head, tap_tail is where the data that hasn't been acknowledged by
+// espconn starts and tap_sending is how much of it is in flight; the indexes are free running
+static char *tap_ring;
+static uint16_t tap_head, tap_tail, tap_sending;
+static uint32_t tap_lost;         // records dropped since the last TLV_TAP_DROP record
+static ETSTimer tap_timer;
+static bool tap_timer_armed;
+
+tlv_tap_stats_t tlv_tap_stats;
+
+bool ICACHE_FLASH_ATTR tlv_tap_active(void) {
+  return tap_ring != NULL;
+}
+
+static void ICACHE_FLASH_ATTR tap_put(const void *data, uint16_t len) {
+  const char *p = data;
+  while (len--) tap_ring[tap_head++ & TAP_RING_MASK] = *p++;
+}
+
+static void ICACHE_FLASH_ATTR tap_put_hdr(uint8_t dir, uint8_t channel, uint8_t len) {
+  uint32_t now = system_get_time();
+  uint8_t hdr[TAP_HDR] = { now, now >> 8, now >> 16, now >> 24, dir, channel, len };
+  tap_put(hdr, TAP_HDR);
+}
+
+// hand the oldest contiguous stretch of the ring to espconn, one send at a time
+static void ICACHE_FLASH_ATTR tap_send(void) {
+  if (tap_conn == NULL || tap_sending != 0 || tap_head == tap_tail) return;
+  uint16_t off = tap_tail & TAP_RING_MASK;
+  uint16_t len = (uint16_t)(tap_head - tap_tail);
+  if (len > TAP_RING - off) len = TAP_RING - off;
+  if (espconn_sent(tap_conn, (uint8_t *) tap_ring + off, len) == ESPCONN_OK)
+    tap_sending = len;
+  // otherwise lwip is out of buffers, the next record or flush will retry
+}
+
+static void ICACHE_FLASH_ATTR tap_timer_cb(void *arg) {
+  tap_timer_armed = false;
+  tap_send();
+}
+
+void ICACHE_FLASH_ATTR tlv_tap_frame(uint8_t dir, uint8_t channel, const char *data, uint8_t len) {
+  if (tap_ring == NULL) return;
+
+  uint16_t need = TAP_HDR + len + (tap_lost ? TAP_HDR + 4 : 0);
+  if ((uint16_t)(tap_head - tap_tail) + need > TAP_RING) {
+    tap_lost++;
+    tlv_tap_stats.dropped++;
+    return;
+  }
+  if (tap_lost) {
+    uint8_t count[4] = { tap_lost, tap_lost >> 8, tap_lost >> 16, tap_lost >> 24 };
+    tap_put_hdr(TLV_TAP_DROP, 0, sizeof(count));
+    tap_put(count, sizeof(count));
+    tap_lost = 0;
+  }
+  tap_put_hdr(dir, channel, len);
+  tap_put(data, len);
+  tlv_tap_stats.records++;
+
+  if (!tap_timer_armed && tap_sending == 0) {
+    os_timer_arm(&tap_timer, TAP_FLUSH_MS, 0);
+    tap_timer_armed = true;
+  }
+}
+
+static void ICACHE_FLASH_ATTR tapSentCb(void *arg) {
+  tap_tail += tap_sending;
+  tap_sending = 0;
+  tap_send();
+}
+
+static void ICACHE_FLASH_ATTR tapDisconCb(void *arg) {
+  if (arg != tap_conn) return;
+  os_timer_disarm(&tap_timer);
+  tap_timer_armed = false;
+  heap_free(tap_ring);
+  tap_ring = NULL;
+  tap_conn = NULL;
+  DBG("TLV tap: client gone, %ld records, %ld dropped\n", tlv_tap_stats.records,
+      tlv_tap_stats.dropped);
+}
+
+static void ICACHE_FLASH_ATTR tapResetCb(void *arg, sint8 err) {
+  tapDisconCb(arg);
+}
+
+static void ICACHE_FLASH_ATTR tapRecvCb(void *arg, char *data, unsigned short len) {
+  // the tap is receive only, whatever the client sends is ignored
+}
+
+static void ICACHE_FLASH_ATTR tapConnectCb(void *arg) {
+  struct espconn *conn = arg;
+  if (tap_conn != NULL) {
+    espconn_disconnect(conn); // one capture at a time
+    return;
+  }
+  tap_ring = heap_malloc(HEAP_TAP, TAP_RING);
+  if (tap_ring == NULL) {
+    os_printf("TLV tap: out of memory\n");
+    espconn_disconnect(conn);
+    return;
+  }
+  tap_conn = conn;
+  tap_head = tap_tail = tap_sending = 0;
+  tap_lost = 0;
+  tlv_tap_stats.clients++;
+
+  espconn_regist_recvcb(conn, tapRecvCb);
+  espconn_regist_disconcb(conn, tapDisconCb);
+  espconn_regist_reconcb(conn, tapResetCb);
+  espconn_regist_sentcb(conn, tapSentCb);
+  espconn_set_opt(conn, ESPCONN_REUSEADDR);
+
+  tap_put(tap_magic, sizeof(tap_magic));
+  tap_send();
+  DBG("TLV tap: client connected\n");
+}
+
+void ICACHE_FLASH_ATTR tlvTapInit(uint16_t port) {
+  if (tap_tcp.local_port == port) return;
+  if (tap_tcp.local_port != 0) {
+    if (tap_conn != NULL) espconn_disconnect(tap_conn);
+    espconn_delete(&tap_listen);
+  }
+  os_memset(&tap_listen, 0, sizeof(tap_listen));
+  os_memset(&tap_tcp, 0, sizeof(tap_tcp));
+  if (port == 0) return;
+
+  os_timer_disarm(&tap_timer);
+  os_timer_setfn(&tap_timer, tap_timer_cb, NULL);
+
+  tap_listen.type = ESPCONN_TCP;
+  tap_listen.state = ESPCONN_NONE;
+  tap_tcp.local_port = port;
+  tap_listen.proto.tcp = &tap_tcp;
+  espconn_regist_connectcb(&tap_listen, tapConnectCb);
+  espconn_accept(&tap_listen);
+  espconn_tcp_set_max_con_allow(&tap_listen, 1);
+  DBG("TLV tap on port %d\n", port);
+}
@@ -0,0 +1,37 @@
+#ifndef __TLV_TAP_H__
+#define __TLV_TAP_H__
+
+#include <esp8266.h>
+
+/* TLV traffic tap: a TCP client connected to the tap port receives a copy of every TLV frame
+ * crossing the serial link, in both directions. The stream starts with the 8 byte magic
+ * "TLVTAP\1\0" followed by records of
+ *   uint32_t time;     system_get_time() in us, little endian, wraps every ~71 minutes
+ *   uint8_t  dir;      TLV_TAP_TX (esp-link to MCU), TLV_TAP_RX (MCU to esp-link), TLV_TAP_DROP
+ *   uint8_t  channel;
+ *   uint8_t  length;
+ *   uint8_t  data[length];
+ * A TLV_TAP_DROP record carries the number of records lost since the previous one as a 4 byte
+ * little endian count. Records are buffered and sent in the background, when the client can't
+ * keep up they are dropped, the live link is never held up. tlv/tlvtap2pcapng.py converts a
+ * capture to pcapng for wireshark.
+ */
+#define TLV_TAP_TX   0
+#define TLV_TAP_RX   1
+#define TLV_TAP_DROP 2
+
+// start (or move, or with port 0 stop) the tap listener
+void tlvTapInit(uint16_t port);
+// record a frame, cheap no-op while no client is connected
+void tlv_tap_frame(uint8_t dir, uint8_t channel, const char *data, uint8_t len);
+
+typedef struct {
+  uint32_t records;           // records queued for the client
+  uint32_t dropped;           // records lost because the client didn't keep up
+  uint32_t clients;           // connections accepted
+} tlv_tap_stats_t;
+extern tlv_tap_stats_t tlv_tap_stats;
+// true while a client is connected
+bool tlv_tap_active(void);
+
+#endif
@@ -0,0 +1,117 @@
+#! /usr/bin/env python3
+# Convert a TLV tap capture (see tlv/tlvtap.h) into pcapng for wireshark.
+#
+#   tlvtap2pcapng.py esp-link:2323 link.pcapng     capture live until ctrl-c
+#   nc esp-link 2323 > link.tap
+#   tlvtap2pcapng.py link.tap link.pcapng          convert a saved stream
+#
+# Packets use link type USER0 (147) and hold the channel byte followed by the TLV data, the
+# direction is in the packet flags (inbound = MCU to esp-link) and records lost on the
+# esp-link side show up as the drop count of the next packet.
+
+import socket
+import struct
+import sys
+import time
+
+MAGIC = b"TLVTAP\x01\x00"
+TX, RX, DROP = 0, 1, 2
+LINKTYPE_USER0 = 147
+
+
+def block(btype, body):
+    body += b"\0" * (-len(body) % 4)
+    length = len(body) + 12
+    return struct.pack("<II", btype, length) + body + struct.pack("<I", length)
+
+
+def option(code, value):
+    return struct.pack("<HH", code, len(value)) + value + b"\0" * (-len(value) % 4)
+
+
+def header(out):
+    out.write(block(0x0A0D0D0A, struct.pack("<IHHq", 0x1A2B3C4D, 1, 0, -1) +
+                    option(4, b"esp-link tlvtap") + option(0, b"")))
+    out.write(block(0x00000001, struct.pack("<HHI", LINKTYPE_USER0, 0, 0) +
+                    option(2, b"tlv") + option(0, b"")))
+
+
+class Converter:
+    def __init__(self, out):
+        self.out = out
+        self.buf = b""
+        self.synced = False
+        self.last = None     # last device timestamp, to unwrap the 32 bit counter
+        self.base = 0        # host time in us matching device time 0
+        self.dropped = 0     # pending drop count for the next packet
+        self.packets = 0
+
+    def feed(self, data):
+        self.buf += data
+        if not self.synced:
+            if len(self.buf) < len(MAGIC):
+                return
+            if self.buf[:len(MAGIC)] != MAGIC:
+                raise ValueError("not a TLV tap stream")
+            self.buf = self.buf[len(MAGIC):]
+            self.synced = True
+        while len(self.buf) >= 7:
+            ts, direction, channel, length = struct.unpack_from("<IBBB", self.buf)
+            if len(self.buf) < 7 + length:
+                break
+            payload = self.buf[7:7 + length]
+            self.buf = self.buf[7 + length:]
+            self.record(ts, direction, channel, payload)
+
+    def record(self, ts, direction, channel, payload):
+        if self.last is None:
+            self.base = int(time.time() * 1e6) - ts
+        elif ts < self.last:
+            self.base += 1 << 32
+        self.last = ts
+        if direction == DROP:
+            self.dropped += struct.unpack("<I", payload)[0]
+            return
+
+        when = self.base + ts
+        data = bytes([channel]) + payload
+        flags = 1 if direction == RX else 2
+        opts = option(2, struct.pack("<I", flags))
+        if self.dropped:
+            opts += option(4, struct.pack("<Q", self.dropped))
+            self.dropped = 0
+        opts += option(0, b"")
+        pad = b"\0" * (-len(data) % 4)
+        self.out.write(block(0x00000006, struct.pack("<IIIII", 0, when >> 32, when & 0xFFFFFFFF,
+                                                     len(data), len(data)) + data + pad + opts))
+        self.packets += 1
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: %s <host:port | capture file> <output.pcapng>" % sys.argv[0])
+    src, dst = sys.argv[1], sys.argv[2]
+    with open(dst, "wb") as out:
+        header(out)
+        conv = Converter(out)
+        if ":" in src:
+            host, port = src.rsplit(":", 1)
+            sock = socket.create_connection((host, int(port)))
+            try:
+                while True:
+                    data = sock.recv(4096)
+                    if not data:
+                        break
+                    conv.feed(data)
+                    out.flush()
+            except KeyboardInterrupt:
+                pass
+            sock.close()
+        else:
+            with open(src, "rb") as f:
+                conv.feed(f.read())
+    print("%d packets written to %s" % (conv.packets, dst))
+
+
+if __name__ == "__main__":
+    main()
@@ -12,11 +12,14 @@
 #endif
 #include "tlv.h"
 #include "task.h"
+#include "txcoalesce.h"
+#include "cpuacct.h"
+#include "heapstat.h"
 
 #define SKIP_AT_RESET
 
-// Send buffer size
-#define MAX_TXBUFFER (1460)
+// Buffer sizes, the send queue holds up to VNC_TXBUFS pooled buffers
+#define VNC_TXBUFS 2
 #define MAX_RXBUFFER (6*1460)
 
 #define VNCBR_DBG
@@ -33,6 +36,8 @@ LOCAL uint8_t deferredTaskNum;
 static struct espconn vncbridgeConn; // plain bridging port
 static esp_tcp vncbridgeTcp;
 
+txc_stats_t vncbridgeTxStats;
+
 static const char RFB_HELLO[] = { 'R','F','B',' ','0','0','3','.','0','0','3','\n' };
 
 static const char AUTH_CHALLENGE[] = { 0x00, 0x00, 0x00, 0x02 /* vncAuth */,
@@ -44,7 +49,11 @@ static const char AUTH_RESPONSE[] = { 0x55, 0xB3, 0x8b, 0x6, 0xAE, 0xE1, 0xD2, 0
 static const char AUTH_OK[] = { 0x00, 0x00, 0x00, 0x00 };
 static const char AUTH_FAILED[] = { 0x00, 0x00, 0x00, 0x01 /* auth failed */, 0x00, 0x00, 0x00, 0x00 /* connfailed */};
 
-static const char INIT_MESSAGE[] = { 0x0B, 0x40 /* 2880 */, 0x07, 0x08 /* 1800 */, /* X/Y resolution. Make it huge to accommodate all screens */
+// X/Y resolution. Make it huge to accommodate all screens
+#define VNC_FB_WIDTH 2880
+#define VNC_FB_HEIGHT 1800
+
+static const char INIT_MESSAGE[] = { VNC_FB_WIDTH >> 8, VNC_FB_WIDTH & 0xFF, VNC_FB_HEIGHT >> 8, VNC_FB_HEIGHT & 0xFF,
   0x08, 0x08, 0x00, 0x01, 0x00, 0x07, 0x00, 0x07, 0x00, 0x03, 0x00, 0x03, 0x06 /* pixelformat */, 0x00, 0x00, 0x00,
   0x00, 0x00, 0x00, 0x06 /* length */, 'V', 'N', 'C', '_', 'K', 'M' };
   
@@ -57,104 +66,46 @@ vncProcessRX(vncbridgeConnData *conn);
 static bool ICACHE_FLASH_ATTR
 emitKeyEvent(bool pressed, uint32 key);
 
+static void ICACHE_FLASH_ATTR
+resetPointer(bool absolute);
+
+static bool ICACHE_FLASH_ATTR
+flushPointerTransition(void);
+
+static void ICACHE_FLASH_ATTR
+resetKeyboard(bool nkro);
+
+static void ICACHE_FLASH_ATTR
+resetHidBatch(bool enabled);
+
 //===== uC -> TCP
 
-// Send all data in conn->txbuffer
-// returns result from espconn_sent if data in buffer or ESPCONN_OK (0)
-// Use only internally from espbuffsend and vncbridgeSentCb
-static sint8 ICACHE_FLASH_ATTR
-sendtxbuffer(vncbridgeConnData *conn)
+// Send the queued data if the previous send has completed and the coalescing policy lets it go
+static void ICACHE_FLASH_ATTR
+sendtxqueue(vncbridgeConnData *conn)
 {
-  sint8 result = ESPCONN_OK;
-  if (conn->txbufferlen != 0) {
-    // DBG("TX %p %d\n", conn, conn->txbufferlen);
-    conn->readytosend = false;
-    result = espconn_sent(conn->conn, (uint8_t*)conn->txbuffer, conn->txbufferlen);
-    conn->txbufferlen = 0;
-    if (result != ESPCONN_OK) {
-      os_printf("sendtxbuffer: espconn_sent error %d on conn %p\n", result, conn);
-      conn->txbufferlen = 0;
-      if (!conn->txoverflow_at) conn->txoverflow_at = system_get_time();
-    } else {
-      conn->sentbuffer = conn->txbuffer;
-      conn->txbuffer = NULL;
-      conn->txbufferlen = 0;
-    }
-  }
-  return result;
+  if (conn->txq.sending != 0) return;
+  if (!txcoalesce_ready(&conn->txc, netq_pending(&conn->txq), NETBUF_SIZE)) return;
+  int len = netq_send(&conn->txq, conn->conn);
+  if (len > 0) txcoalesce_sent(&conn->txc, len);
 }
 
-// espbuffsend adds data to the send buffer. If the previous send was completed it calls
-// sendtxbuffer and espconn_sent.
-// Returns ESPCONN_OK (0) for success, -128 if buffer is full or error from  espconn_sent
-// Use espbuffsend instead of espconn_sent as it solves the problem that espconn_sent must
-// only be called *after* receiving an espconn_sent_callback for the previous packet.
+// espbuffsend queues data for the client and sends it as soon as possible. espconn_sent must
+// only be called *after* receiving an espconn_sent_callback for the previous packet, the queue
+// takes care of that.
+// Returns ESPCONN_OK (0) for success, -128 if the queue is full
 static sint8 ICACHE_FLASH_ATTR
 espbuffsend(vncbridgeConnData *conn, const char *data, uint16 len)
 {
-  if (conn->txbufferlen >= MAX_TXBUFFER) goto overflow;
-
-  // make sure we indeed have a buffer
-  if (conn->txbuffer == NULL) conn->txbuffer = os_zalloc(MAX_TXBUFFER);
-  if (conn->txbuffer == NULL) {
-    os_printf("vnc_espbuffsend: cannot alloc tx buffer\n");
-    return -128;
-  }
-
-  // add to send buffer
-  uint16_t avail = conn->txbufferlen+len > MAX_TXBUFFER ? MAX_TXBUFFER-conn->txbufferlen : len;
-  os_memcpy(conn->txbuffer + conn->txbufferlen, data, avail);
-  conn->txbufferlen += avail;
-
-  // try to send
-  sint8 result = ESPCONN_OK;
-  if (conn->readytosend) {
-    result = sendtxbuffer(conn);
-  } else {
-    // syslog(SYSLOG_FAC_USER, SYSLOG_PRIO_NOTICE, "esp-link", "espbuffsend: Not ready to send\n");
-  }
-
-  if (avail < len && result == ESPCONN_OK) {
-    // syslog(SYSLOG_FAC_USER, SYSLOG_PRIO_NOTICE, "esp-link", "espbuffsend: some data didn't fit in the buffer\n");
-    // some data didn't fit into the buffer
-    if (conn->txbufferlen == 0) {
-      // we sent the prior buffer, so try again
-      return espbuffsend(conn, data+avail, len-avail);
-    }
-    goto overflow;
-  }
-  // syslog(SYSLOG_FAC_USER, SYSLOG_PRIO_NOTICE, "esp-link", "espbuffsend: result is %d\n", result);
+  sint8 result = netq_append(&conn->txq, conn->conn, data, len);
+  sendtxqueue(conn);
   return result;
-
-overflow:
-  if (conn->txoverflow_at) {
-    // we've already been overflowing
-    if (system_get_time() - conn->txoverflow_at > 10*1000*1000) {
-      // no progress in 10 seconds, kill the connection
-      os_printf("vncbridge: killing overflowing stuck conn %p\n", conn);
-      espconn_disconnect(conn->conn);
-    }
-    // else be silent, we already printed an error
-  } else {
-    // print 1-time message and take timestamp
-    os_printf("vncbridge: txbuffer full, conn %p\n", conn);
-    conn->txoverflow_at = system_get_time();
-  }
-  return -128;
 }
 
 static sint8 ICACHE_FLASH_ATTR
 espbuffsend_static(vncbridgeConnData *conn, const char *data, uint16 len) {
-  char *buff = os_zalloc(len);
-  if (buff == NULL) {
-    os_printf("espbuffsend_static: cannot alloc tx buffer\n");
-    return -128;
-  }
-  
-  os_memcpy(buff, data, len);
-  sint8 ret = espbuffsend(conn, buff, len);
-  os_free(buff);
-  return ret;
+  // the queue copies the data, so constant messages can be queued directly
+  return espbuffsend(conn, data, len);
 }
 
 //callback after the data are sent
@@ -164,11 +115,16 @@ vncbridgeSentCb(void *arg)
   vncbridgeConnData *conn = ((struct espconn*)arg)->reverse;
   //DBG("Sent CB %p\n", conn);
   if (conn == NULL) return;
-  if (conn->sentbuffer != NULL) os_free(conn->sentbuffer);
-  conn->sentbuffer = NULL;
-  conn->readytosend = true;
-  conn->txoverflow_at = 0;
-  sendtxbuffer(conn); // send possible new data in txbuffer
+  netq_sent(&conn->txq);
+  sendtxqueue(conn); // send possible new data
+}
+
+// Coalescing timer: held data is due
+static void ICACHE_FLASH_ATTR
+vncbridgeFlush(void *arg)
+{
+  vncbridgeConnData *conn = arg;
+  if (conn->conn != NULL) sendtxqueue(conn);
 }
 
 //===== Connect / disconnect
@@ -180,15 +136,12 @@ vncbridgeDisconCb(void *arg)
   vncbridgeConnData *conn = ((struct espconn*)arg)->reverse;
   if (conn == NULL) return;
   DBG("Closing connection\n");
+  txcoalesce_stop(&conn->txc);
   // Free buffers
-  if (conn->sentbuffer != NULL) os_free(conn->sentbuffer);
-  conn->sentbuffer = NULL;
-  if (conn->txbuffer != NULL) os_free(conn->txbuffer);
-  conn->txbuffer = NULL;
-  conn->txbufferlen = 0;
+  netq_free(&conn->txq);
   if (conn->rxbuffer != NULL && conn->rxbufferlen == 0) {
     DBG("VNC Freed RX buffer\n");
-    os_free(conn->rxbuffer);
+    heap_free(conn->rxbuffer);
     DBG("VncDisc: RX at %p\n", conn->rxbuffer);
     conn->rxbuffer = NULL;
   } else {
@@ -212,19 +165,27 @@ vncbridgeRecvCb(void *arg, char *data, unsigned short len)
 {
   vncbridgeConnData *conn = ((struct espconn*)arg)->reverse;
   if (conn == NULL) return;
-  if (conn->rxbufferlen + len > MAX_RXBUFFER) {
+  if (conn->rxbufferlen - conn->rxbufferpos + len > MAX_RXBUFFER) {
     os_printf("RX buffer overrun!\n");
     espconn_disconnect(conn->conn);
     return;
   }
   sint8_t res = espconn_recv_hold(conn->conn);
   if (res != 0) os_printf("Hold: %d\n", res);
+  if (conn->rxbufferlen + len > MAX_RXBUFFER) {
+    // no room at the end, move the unconsumed data (typically a partial message) to the front
+    conn->rxbufferlen -= conn->rxbufferpos;
+    os_memmove(conn->rxbuffer, conn->rxbuffer + conn->rxbufferpos, conn->rxbufferlen);
+    conn->rxbufferpos = 0;
+  }
   os_memcpy(conn->rxbuffer+conn->rxbufferlen, data, len);
   conn->rxbufferlen += len;
   // DBG("RX += %d, now %d\n", len, conn->rxbufferlen);
   post_usr_task(deferredTaskNum, 0);
 }
 
+CPUACCT_RECV(vncbridgeRecvCb, "vnc recv")
+CPUACCT_CB(vncbridgeSentCb, "vnc sent")
 
 // New connection callback, use one of the connection descriptors, if we have one left.
 static void ICACHE_FLASH_ATTR
@@ -244,10 +205,15 @@ vncbridgeConnectCb(void *arg)
   os_memset(vncConnData+i, 0, sizeof(struct vncbridgeConnData));
   vncConnData[i].conn = conn;
   conn->reverse = vncConnData+i;
-  vncConnData[i].readytosend = true;
+  netq_init(&vncConnData[i].txq, VNC_TXBUFS);
+  resetPointer(flashConfig.vnc_pointer != 0);
+  resetKeyboard(flashConfig.vnc_keyboard != 0);
+  resetHidBatch(flashConfig.vnc_batch != 0);
+  txcoalesce_init(&vncConnData[i].txc, flashConfig.vnc_tx_mode, flashConfig.vnc_tx_delay_us,
+      flashConfig.vnc_tx_bytes, &vncbridgeTxStats, vncbridgeFlush, vncConnData+i);
 
   // allocate the rx buffer
-  vncConnData[i].rxbuffer = os_zalloc(MAX_RXBUFFER);
+  vncConnData[i].rxbuffer = heap_zalloc(HEAP_VNC, MAX_RXBUFFER);
   vncConnData[i].rxbufferlen = 0;
   if (vncConnData[i].rxbuffer == NULL) {
     os_printf("Out of memory for RX buffer\n");
@@ -255,10 +221,10 @@ vncbridgeConnectCb(void *arg)
     return;
   }
 
-  espconn_regist_recvcb(conn, vncbridgeRecvCb);
+  espconn_regist_recvcb(conn, vncbridgeRecvCb_acct);
   espconn_regist_disconcb(conn, vncbridgeDisconCb);
   espconn_regist_reconcb(conn, vncbridgeResetCb);
-  espconn_regist_sentcb(conn, vncbridgeSentCb);
+  espconn_regist_sentcb(conn, vncbridgeSentCb_acct);
 
   espconn_set_opt(conn, ESPCONN_REUSEADDR|ESPCONN_NODELAY);
   espbuffsend_static(&vncConnData[i], RFB_HELLO, sizeof(RFB_HELLO));
@@ -487,8 +453,139 @@ mapKey(uint32 key) {
   }
 }
 
+// HID reports produced during one deferredTask pass, sent as a single TLV_HID_BATCH frame at the
+// end of the pass (or earlier if the frame fills up) so the link carries many reports per round
+// trip instead of one. Batching is latched per connection from flashConfig.vnc_batch.
+static struct {
+  bool    enabled;
+  uint8_t count;                // number of reports in buf
+  uint8_t len;                  // bytes used in buf
+  uint8_t buf[TLV_MAX_PACKET];  // starts with TLV_HID_BATCH, then len/report pairs
+} hid_batch;
+
+static void ICACHE_FLASH_ATTR
+resetHidBatch(bool enabled) {
+  hid_batch.enabled = enabled;
+  hid_batch.count = 0;
+  hid_batch.len = 1;
+  hid_batch.buf[0] = TLV_HID_BATCH;
+}
+
+// Send the queued reports, a single report goes out on its own. Returns false if the link is
+// paused, in which case the reports stay queued.
+static bool ICACHE_FLASH_ATTR
+flushHidBatch(void) {
+  if (hid_batch.count == 0)
+    return true;
+  int8_t res = hid_batch.count == 1
+    ? tlv_send(TLV_HID, (char *) hid_batch.buf+2, hid_batch.buf[1])
+    : tlv_send(TLV_HID, (char *) hid_batch.buf, hid_batch.len);
+  if (res != 0)
+    return false;
+  resetHidBatch(hid_batch.enabled);
+  return true;
+}
+
+// Send a HID report, or queue it for the batch. Returns false if the report can't be accepted
+// because the link is paused (and, when batching, the batch is full).
+static bool ICACHE_FLASH_ATTR
+hidSend(uint8_t *report, uint8_t len) {
+  if (!hid_batch.enabled)
+    return tlv_send(TLV_HID, (char *) report, len) == 0;
+  if (hid_batch.len + 1 + len > TLV_MAX_PACKET && !flushHidBatch())
+    return false;
+  hid_batch.buf[hid_batch.len++] = len;
+  os_memcpy(hid_batch.buf + hid_batch.len, report, len);
+  hid_batch.len += len;
+  hid_batch.count++;
+  return true;
+}
+
+// Keyboard state for the change based (NKRO) reports, the report type is latched per connection
+// from flashConfig.vnc_keyboard
+static struct {
+  bool    nkro;                 // send TLV_HID_KEY_* changes instead of 2-byte reports
+  bool    sync;                 // the full state has to be sent before the next change
+  uint8_t modifiers;
+  uint8_t pressed[32];          // bitmap of pressed usages
+} keyboard;
+
+static bool ICACHE_FLASH_ATTR
+isPressed(uint8_t usage) {
+  return (keyboard.pressed[usage >> 3] & (1 << (usage & 7))) != 0;
+}
+
+static void ICACHE_FLASH_ATTR
+resetKeyboard(bool nkro) {
+  os_memset(&keyboard, 0, sizeof(keyboard));
+  keyboard.nkro = nkro;
+  keyboard.sync = nkro; // release anything a previous client left pressed
+}
+
+// Send the complete keyboard state, returns false if the link is paused
+static bool ICACHE_FLASH_ATTR
+syncKeyboard(void) {
+  uint8_t report[TLV_HID_KEY_STATE_LEN];
+  report[0] = TLV_HID_KEY_STATE;
+  report[1] = keyboard.modifiers;
+  os_memcpy(report+2, keyboard.pressed, sizeof(keyboard.pressed));
+  if (!hidSend(report, sizeof(report)))
+    return false;
+  keyboard.sync = false;
+  return true;
+}
+
+// Send a 3-byte report for the key that changed, nothing is sent if the event doesn't change
+// the state (e.g. auto-repeat from the client). Returns false if the link is paused.
+static bool ICACHE_FLASH_ATTR
+emitKeyChange(bool pressed, uint32 key) {
+  if (keyboard.sync && !syncKeyboard())
+    return false;
+
+  uint8_t modifiers = keyboard.modifiers;
+  uint8_t modifier = getModifier(key);
+  if (modifier != 0) {
+    if (pressed) {
+      modifiers |= modifier;
+      if ((modifiers & (1<<1 | 1<<5)) == (1<<1 | 1<<5)) { // left-shift && right-shift
+        // reset key state
+        os_memset(keyboard.pressed, 0, sizeof(keyboard.pressed));
+        keyboard.modifiers = 0;
+        keyboard.sync = true;
+        syncKeyboard(); // if the link is paused it goes out ahead of the next change
+        return true;
+      }
+    } else
+      modifiers &= ~modifier;
+  }
+
+  uint8_t usage = mapKey(key);
+  if (usage != 0 && isPressed(usage) == pressed)
+    usage = 0; // no change to the key itself
+  if (usage == 0 && modifiers == keyboard.modifiers)
+    return true;
+
+  uint8_t report[TLV_HID_KEY_LEN] = { pressed ? TLV_HID_KEY_DOWN : TLV_HID_KEY_UP, modifiers, usage };
+  if (!hidSend(report, sizeof(report)))
+    return false;
+  keyboard.modifiers = modifiers;
+  if (usage != 0) {
+    if (pressed)
+      keyboard.pressed[usage >> 3] |= 1 << (usage & 7);
+    else
+      keyboard.pressed[usage >> 3] &= ~(1 << (usage & 7));
+  }
+  return true;
+}
+
 static bool ICACHE_FLASH_ATTR
 emitKeyEvent(bool pressed, uint32 key) {
+  // a click that hasn't gone out yet came first in the RFB stream, so it goes first
+  if (!flushPointerTransition())
+    return false;
+  if (keyboard.nkro)
+    return emitKeyChange(pressed, key);
+
   static uint8_t keys[7];
   uint8_t newKeys[7];
   os_memcpy(newKeys, keys, sizeof(keys));
@@ -525,9 +622,9 @@ emitKeyEvent(bool pressed, uint32 key) {
   }
 
   if (memcmp(keys, newKeys, sizeof(keys)) != 0) {
-    // FIXME: For performance, we only send 2 bytes, modifier and key
-    // as a result, we cannot do n-key rollover
-    if (tlv_send(TLV_HID, (char *) newKeys, 2) != 0)
+    // Only modifier and first key are sent, so there is no n-key rollover in this mode,
+    // use the TLV_HID_KEY_* reports (flashConfig.vnc_keyboard) for that
+    if (!hidSend(newKeys, 2))
       return false;
     os_memcpy(keys, newKeys, sizeof(keys));
   }
@@ -535,32 +632,145 @@ emitKeyEvent(bool pressed, uint32 key) {
 }
 
 static int8_t pointer_event[] = {0, -1, -1, 0};
+static uint8_t abs_pointer_event[TLV_HID_ABS_POINTER_LEN] = { TLV_HID_ABS_POINTER };
+
+// Pointer state: the last absolute position received from the client and the motion that is
+// still owed to the MCU. While the TLV link is paused consecutive PointerEvents with the same
+// button mask are coalesced here and go out as a single report once the link resumes: relative
+// motion is summed up, in absolute mode the latest position simply wins. A report that changes
+// the buttons is never coalesced with what follows it, until it has gone out the RFB stream
+// stalls behind it.
+// The report type is latched per connection from flashConfig.vnc_pointer.
+static struct {
+  bool    absolute;             // send absolute (digitizer) reports instead of mouse deltas
+  int     old_x, old_y;         // last position seen, -1 if none yet
+  int32_t dx, dy, dz;           // motion not yet sent
+  uint8_t buttons;              // button mask belonging to the pending motion
+  uint8_t sent_buttons;         // button mask of the last report handed to hidSend
+  bool    pending;              // a report is owed to the MCU
+} pointer = { false, -1, -1, 0, 0, 0, 0, 0, false };
+
+static int8_t ICACHE_FLASH_ATTR
+clampDelta(int32_t d) {
+  return d > 127 ? 127 : d < -127 ? -127 : d;
+}
+
+// scale a framebuffer coordinate to 0..TLV_HID_ABS_MAX
+static uint16_t ICACHE_FLASH_ATTR
+scaleAbs(int v, int size) {
+  if (v >= size) v = size - 1;
+  return (uint32_t) v * TLV_HID_ABS_MAX / (size - 1);
+}
 
+// Send one absolute report for the current position, returns false if the link is paused
 static bool ICACHE_FLASH_ATTR
-emitPointerEvent(int mask, int x, int y, int z) {
-  static int old_x = -1, old_y = -1;
-  
-  if (old_x != -1) {
-    
-    pointer_event[0] = mask;
-    pointer_event[1] = x - old_x;
-    pointer_event[2] = y - old_y;
-    pointer_event[3] = z;
-    if (tlv_send(TLV_HID, (char *) pointer_event, 4) != 0)
+flushAbsPointerEvent(void) {
+  uint16_t x = scaleAbs(pointer.old_x, VNC_FB_WIDTH);
+  uint16_t y = scaleAbs(pointer.old_y, VNC_FB_HEIGHT);
+  abs_pointer_event[1] = pointer.buttons;
+  abs_pointer_event[2] = x & 0xFF;
+  abs_pointer_event[3] = x >> 8;
+  abs_pointer_event[4] = y & 0xFF;
+  abs_pointer_event[5] = y >> 8;
+  abs_pointer_event[6] = clampDelta(pointer.dz);
+  if (!hidSend(abs_pointer_event, TLV_HID_ABS_POINTER_LEN))
+    return false;
+  pointer.sent_buttons = pointer.buttons;
+  pointer.dz -= (int8_t) abs_pointer_event[6];
+  pointer.pending = pointer.dz != 0;
+  return true;
+}
+
+// Send the pending pointer motion, split into several reports if it doesn't fit into the int8
+// deltas. Returns false if the link is paused and some of it is still pending.
+static bool ICACHE_FLASH_ATTR
+flushPointerEvent(void) {
+  while (pointer.pending) {
+    if (pointer.absolute) {
+      if (!flushAbsPointerEvent())
+        return false;
+      continue;
+    }
+    pointer_event[0] = pointer.buttons;
+    pointer_event[1] = clampDelta(pointer.dx);
+    pointer_event[2] = clampDelta(pointer.dy);
+    pointer_event[3] = clampDelta(pointer.dz);
+    if (!hidSend((uint8_t *) pointer_event, 4))
       return false;
+    pointer.sent_buttons = pointer.buttons;
+    pointer.dx -= pointer_event[1];
+    pointer.dy -= pointer_event[2];
+    pointer.dz -= pointer_event[3];
+    pointer.pending = pointer.dx != 0 || pointer.dy != 0 || pointer.dz != 0;
   }
-  old_x = x;
-  old_y = y;
   return true;
 }
 
+static void ICACHE_FLASH_ATTR
+resetPointer(bool absolute) {
+  pointer.absolute = absolute;
+  pointer.old_x = pointer.old_y = -1;
+  pointer.dx = pointer.dy = pointer.dz = 0;
+  pointer.buttons = pointer.sent_buttons = 0;
+  pointer.pending = false;
+}
+
+// Send the pending report if it changes the buttons, nothing that comes after it in the RFB
+// stream may overtake it. Returns false if the link is paused.
+static bool ICACHE_FLASH_ATTR
+flushPointerTransition(void) {
+  if (!pointer.pending || pointer.buttons == pointer.sent_buttons)
+    return true;
+  return flushPointerEvent();
+}
+
+// Returns false only if a button transition cannot be sent yet, plain motion is accepted and
+// coalesced with pending motion as long as no transition is waiting.
+static bool ICACHE_FLASH_ATTR
+emitPointerEvent(int mask, int x, int y, int z) {
+  // a button transition must not be merged with the motion that preceded it
+  if (pointer.pending && pointer.buttons != mask && !flushPointerEvent())
+    return false;
+  // nor with the motion that follows it, the click would land where the drag ends
+  if (!flushPointerTransition())
+    return false;
+  if (pointer.absolute) {
+    // absolute reports need no previous position, every event is a complete report
+    pointer.buttons = mask;
+    pointer.old_x = x;
+    pointer.old_y = y;
+    pointer.dz += z;
+    pointer.pending = true;
+    // a button change goes into the batch right away to keep its place among the key reports,
+    // only plain motion is coalesced until the end of the pass
+    if (!hid_batch.enabled || mask != pointer.sent_buttons) flushPointerEvent();
+    return true;
+  }
+  if (pointer.old_x != -1) {
+    pointer.buttons = mask;
+    pointer.dx += x - pointer.old_x;
+    pointer.dy += y - pointer.old_y;
+    pointer.dz += z;
+    pointer.pending = true;
+    if (!hid_batch.enabled || mask != pointer.sent_buttons) flushPointerEvent(); // as above
+  }
+  pointer.old_x = x;
+  pointer.old_y = y;
+  return true;
+}
+
+// Parse RFB messages in place: conn->rxbufferpos is advanced past each message that has been
+// handled and the buffer is only rewound once it has been consumed completely, so a burst of
+// small messages costs no data moves at all.
 int8 ICACHE_FLASH_ATTR
 vnc_proto_handler(vncbridgeConnData *conn) {
-  while (conn->rxbufferlen > 0) {
+  while (conn->rxbufferpos < conn->rxbufferlen) {
+    const uint8_t *rx = (const uint8_t *) conn->rxbuffer + conn->rxbufferpos;
+    uint16 avail = conn->rxbufferlen - conn->rxbufferpos;
     uint16 consume = 0;
     switch (conn->state) {
     case CLIENT_HELLO:
-      if (conn->rxbufferlen < 12)
+      if (avail < 12)
         return true; // need more input
       // DBG("Received client hello\n");
 
@@ -570,12 +780,12 @@ vnc_proto_handler(vncbridgeConnData *conn) {
       consume = 12;
       break;
     case CLIENT_AUTH:
-      if (conn->rxbufferlen < 16)
+      if (avail < 16)
         return true; // need more input
       // DBG("Received Client_auth\n");
       bool authSuccessful = true;
       for (int i = 0; i < 16; i++) {
-        if (conn->rxbuffer[i] != AUTH_RESPONSE[i]) {
+        if (rx[i] != (uint8_t) AUTH_RESPONSE[i]) {
           authSuccessful = false;
         }
       }
@@ -598,73 +808,75 @@ vnc_proto_handler(vncbridgeConnData *conn) {
       conn->state = RFB_MESSAGE;
       break;
     case RFB_MESSAGE:
-      switch (conn->rxbuffer[0]) {
+      switch (rx[0]) {
         case SetPixelFormat:
           // DBG("SetPixelFormat\r\n");
-          if (conn->rxbufferlen < 20)
+          if (avail < 20)
             return true;
           // discard the request
           consume = 20;
           break;
        case FixColourMapEntries:
           // DBG("FixColorMapEntries\n");
-          if (conn->rxbufferlen < 6)
+          if (avail < 6)
             return true;
-          int entries = conn->rxbuffer[4] << 8 | conn->rxbuffer[5];
-          if (conn->rxbufferlen < 6 + entries * 6)
+          int entries = rx[4] << 8 | rx[5];
+          if (avail < 6 + entries * 6)
             return true;
           consume = 6 + 6 * entries;
           break;
         case SetEncodings:
           // DBG("SetEncodings\n");
-          if (conn->rxbufferlen < 4)
+          if (avail < 4)
             return true;
-          int nCodings = conn->rxbuffer[2] << 8 | conn->rxbuffer[3];
-          if (conn->rxbufferlen < 4 + nCodings * 4)
+          int nCodings = rx[2] << 8 | rx[3];
+          if (avail < 4 + nCodings * 4)
             return true;
           consume = 4 + nCodings * 4;
           break;
         case FrameBufferUpdateRequest:
           // DBG("FramebufferUpdateRequest\n");
-          if (conn->rxbufferlen < 10)
+          if (avail < 10)
             return true;
           consume = 10;
           // we don't respond to these
           break;
         case KeyEvent:
           // DBG("KeyEvent\n");
-          if (conn->rxbufferlen < 8)
+          if (avail < 8)
             return true;
           consume = 8;
-          bool pressed = conn->rxbuffer[1] == 1;
-          uint32 key = ((uint32) (conn->rxbuffer[4] << 24)) | (conn->rxbuffer[5] << 16) | (conn->rxbuffer[6] << 8) | (conn->rxbuffer[7]);
+          bool pressed = rx[1] == 1;
+          uint32 key = ((uint32) rx[4] << 24) | (rx[5] << 16) | (rx[6] << 8) | (rx[7]);
           if (!emitKeyEvent(pressed, key))
             return true;
           break;
         case PointerEvent:
           // DBG("PointerEvent\n");
-          if (conn->rxbufferlen < 6)
+          if (avail < 6)
             return true;
           consume = 6;
-          uint8 mask = conn->rxbuffer[1];
-          int32 x = conn->rxbuffer[2] << 8 | conn->rxbuffer[3];
-          int32 y = conn->rxbuffer[4] << 8 | conn->rxbuffer[5];
+          uint8 mask = rx[1];
+          int32 x = rx[2] << 8 | rx[3];
+          int32 y = rx[4] << 8 | rx[5];
           if (!emitPointerEvent(mask, x, y, 0))
             return true;
           break;
         case ClientCutText:
-          if (conn->rxbufferlen < 8)
+          if (avail < 8)
             return true;
           consume = 8;
-          conn->cut_text = (conn->rxbuffer[4] << 24) | (conn->rxbuffer[5] << 16) | (conn->rxbuffer[6] | 8) | (conn->rxbuffer[7]);
+          conn->cut_text = ((uint32) rx[4] << 24) | (rx[5] << 16) | (rx[6] << 8) | (rx[7]);
           conn->state = CUT_TEXT;
           break;
+        default:
+          os_printf("vncbridge: unknown RFB message %d\n", rx[0]);
+          return false;
         }
         break;
       case CUT_TEXT:
-        consume = conn->cut_text;
-        if (consume > conn->rxbufferlen)
-          consume = conn->rxbufferlen;
+        // compared in 32 bits, a length that's a multiple of 64K would otherwise consume nothing
+        consume = conn->cut_text < avail ? conn->cut_text : avail;
         conn->cut_text -= consume;
         if (conn->cut_text == 0)
           conn->state = RFB_MESSAGE;
@@ -672,12 +884,11 @@ vnc_proto_handler(vncbridgeConnData *conn) {
     default:
       return false;
     }
-    if (consume > 0) {
-      os_memcpy(conn->rxbuffer, conn->rxbuffer + consume, conn->rxbufferlen - consume);
-      conn->rxbufferlen -= consume;
-      // DBG("consumed 0x%X, 0x%X remain\n", consume, conn->rxbufferlen);
-    }
+    conn->rxbufferpos += consume;
+    // DBG("consumed 0x%X, 0x%X remain\n", consume, conn->rxbufferlen - conn->rxbufferpos);
   }
+  // everything has been consumed, rewind the buffer
+  conn->rxbufferlen = conn->rxbufferpos = 0;
   return true;
 }
 
@@ -685,7 +896,7 @@ static void ICACHE_FLASH_ATTR
 vncProcessRX(vncbridgeConnData *conn) {
   if (!vnc_proto_handler(conn)) {
     // discard any pending data
-    conn->rxbufferlen = 0;
+    conn->rxbufferlen = conn->rxbufferpos = 0;
     //close connection
     DBG("proto says to close connection!\n");
     espconn_disconnect(conn->conn);
@@ -728,20 +939,30 @@ deferredTask(os_event_t *events)
       vncProcessRX(&vncConnData[c]);
       DBG_RATE(1000*1000, "Heap: %ld\n", (unsigned long) system_get_free_heap_size());
     }
-    if (vncConnData[c].conn != NULL && vncConnData[c].rxbufferlen < 32) {
+    // an unsent click keeps its place ahead of the keyboard state, coalesced motion goes out
+    // after the RFB stream so keys never wait behind it
+    if (vncConnData[c].conn != NULL && (!flushPointerTransition() || (keyboard.sync && !syncKeyboard())))
+      more = true;
+    if (vncConnData[c].conn != NULL && !flushPointerEvent())
+      more = true;
+    if (vncConnData[c].conn != NULL && !flushHidBatch())
+      more = true;
+    // a partial RFB message can only complete with more input, so only hold while blocked on TLV
+    if (vncConnData[c].conn != NULL && (vncConnData[c].rxbufferlen - vncConnData[c].rxbufferpos < 32 ||
+        !tlv_channel_blocked(TLV_HID))) {
       espconn_recv_unhold(vncConnData[c].conn);
     } else if (vncConnData[c].conn == NULL && vncConnData[c].rxbuffer != NULL && vncConnData[c].rxbufferlen == 0) {
       DBG("Freed RX buffer\n");
-      os_free(vncConnData[c].rxbuffer);
+      heap_free(vncConnData[c].rxbuffer);
       DBG("VncDefr: RX at %p\n", vncConnData[c].rxbuffer);
       vncConnData[c].rxbuffer = NULL;
       vncConnData[c].rxbufferlen = 0;
     }
-    if (vncConnData[c].rxbufferlen > 0)
+    if (vncConnData[c].rxbufferlen > 0 && tlv_channel_blocked(TLV_HID))
       more = true;
   }
-  if (more) // data awaits, schedule it ourselves
-    post_usr_task(deferredTaskNum, 0);
+  if (more) // data awaits, runs again now or once TLV can take it
+    tlv_reschedule(TLV_HID);
 }
 
 // Start vnc bridge TCP server on specified port (typ. 5900)
@@ -766,5 +987,6 @@ vncbridgeInit(int port)
 
   tlv_register_channel_handler(TLV_HID, vncTlvCb);
 
-  deferredTaskNum = register_usr_task(deferredTask);
+  deferredTaskNum = register_usr_task_prio(deferredTask, USR_TASK_PRIO_HID, "vnc");
+  tlv_register_wakeup(TLV_HID, deferredTaskNum);
 }
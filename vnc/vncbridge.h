@@ -4,6 +4,8 @@
 #include <ip_addr.h>
 #include <c_types.h>
 #include <espconn.h>
+#include "txcoalesce.h"
+#include "netbuf.h"
 
 #define VNC_MAX_CONN 1
 #define VNC_BRIDGE_TIMEOUT 300 // 300 seconds = 5 minutes
@@ -28,18 +30,18 @@ typedef enum {
 
 typedef struct vncbridgeConnData {
   struct espconn *conn;
-  uint16         rxbufferlen;   // length of data in rxbuffer
+  uint16         rxbufferlen;   // end of data in rxbuffer
+  uint16         rxbufferpos;   // start of unconsumed data in rxbuffer
   char           *rxbuffer;     // buffer for received data
   bool		 recv_hold;     // is the connection on hold
   VncState       state;         // the next message to be processed
   uint32         cut_text;      // how much data to be read in cut_text state
-  uint16         txbufferlen;   // length of data in txbuffer
-  char           *txbuffer;     // buffer for the data to send
-  char           *sentbuffer;   // buffer sent, awaiting callback to get freed
-  uint32_t       txoverflow_at; // when the transmitter started to overflow
-  bool           readytosend;   // true, if txbuffer can be sent by espconn_sent
+  netq_t         txq;           // data to send
+  txcoalesce_t   txc;           // send coalescing state
 } vncbridgeConnData;
 
+extern txc_stats_t vncbridgeTxStats;
+
 void ICACHE_FLASH_ATTR vncbridgeInit(int port);
 void ICACHE_FLASH_ATTR vncbridgeInitPins(void);
 void ICACHE_FLASH_ATTR vncbridgeUartCb(char *buf, short len);